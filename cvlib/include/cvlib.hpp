@@ -8,22 +8,103 @@
 #define __CVLIB_HPP__
 
 #include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 
 namespace cvlib
 {
+/// \brief Region found by split and merge segmentation
+struct segmented_region
+{
+    cv::Rect bbox;
+    int count; //< number of pixels
+    cv::Scalar mean; //< every channel
+    cv::Scalar variance;
+};
+
 /// \brief Split and merge algorithm for image segmentation
+/// \param image, in - input image with up to 4 channels
+/// \param stddev, in - threshold to treat regions as homogeneous, it is compared with deviation of every channel
+/// \param min_size, in - regions are not split into parts smaller than this size
+/// \param max_depth, in - max depth of splitting, non-positive value means no limit
+/// \return segmented image, every region is filled with its mean
+cv::Mat split_and_merge(const cv::Mat& image, double stddev, int min_size = 1, int max_depth = 0);
+
+/// \brief Split and merge algorithm for image segmentation into labeled regions, pixel values are never written
 /// \param image, in - input image
 /// \param stddev, in - threshold to treat regions as homogeneous
+/// \param labels, out - CV_32S map of region indices
+/// \param regions, out - statistics of every region
+/// \param min_size, in - regions are not split into parts smaller than this size
+/// \param max_depth, in - max depth of splitting, non-positive value means no limit
+void split_and_merge(const cv::Mat& image, double stddev, cv::Mat& labels, std::vector<segmented_region>& regions, int min_size = 1, int max_depth = 0);
+
+/// \brief Split and merge algorithm for large image read tile by tile, so only one tile is kept in memory
+/// \details tiles are segmented separately, then regions touching across tile borders are merged by the same criterion
+/// \param size, in - image size
+/// \param tile, in - tile size
+/// \param stddev, in - threshold to treat regions as homogeneous
+/// \param read, in - gives pixels of requested image area
+/// \param write, in - takes CV_32S map of provisional region indices for every tile area
+/// \param relabel, out - index of final region for every provisional one
+/// \param regions, out - statistics of every final region
+void split_and_merge(cv::Size size, cv::Size tile, double stddev, const std::function<cv::Mat(const cv::Rect&)>& read,
+                     const std::function<void(const cv::Rect&, const cv::Mat&)>& write, std::vector<int>& relabel,
+                     std::vector<segmented_region>& regions);
+
+/// \brief Fill every labeled region with its mean
+/// \param labels, in - CV_32S map of region indices
+/// \param regions, in - statistics of every region
+/// \param type, in - type of output image
 /// \return segmented image
-cv::Mat split_and_merge(const cv::Mat& image, double stddev);
+cv::Mat paint_regions(const cv::Mat& labels, const std::vector<segmented_region>& regions, int type);
+
+struct segmentation_state;
+
+/// \brief Split and merge segmentation of video stream, segmentation of the previous frame is reused where the frame is not changed
+class split_and_merge_stream
+{
+    public:
+    /// \brief ctor
+    /// \param stddev, in - threshold to treat regions as homogeneous
+    /// \param tolerance, in - max change of mean or standard deviation of block treated as noise
+    /// \param block, in - size of square blocks of frame compared with the previous frames
+    split_and_merge_stream(double stddev, double tolerance = 2, int block = 16);
+
+    /// \brief setup threshold to treat regions as homogeneous, the next frame is segmented from scratch if it is changed
+    void set_stddev(double stddev);
+
+    /// \brief segment the next frame
+    /// \see split_and_merge
+    void apply(const cv::Mat& frame, cv::Mat& labels, std::vector<segmented_region>& regions);
+
+    /// \brief segment the next frame
+    /// \return frame with every region filled with its mean
+    cv::Mat apply(const cv::Mat& frame);
+
+    private:
+    double stddev_;
+    double tolerance_;
+    int block_;
+    cv::Ptr<segmentation_state> state_; //< tree, regions and block statistics of the previous frame
+};
 
 /// \brief Segment texuture on passed image according to sample in ROI
-/// \param image, in - input image
+/// \param image, in - input single-channel image
 /// \param roi, in - region with sample texture on passed image
 /// \param eps, in - threshold parameter for texture's descriptor distance
+/// \param rank, in - number of separable kernels approximating every Gabor kernel, non-positive value means exact filtering
 /// \return binary mask with selected texture
-cv::Mat select_texture(const cv::Mat& image, const cv::Rect& roi, double eps);
+cv::Mat select_texture(const cv::Mat& image, const cv::Rect& roi, double eps, int rank = 0);
+
+/// \brief Texture descriptor used by select_texture: mean and standard deviation of responses of Gabor filters
+/// \param image, in - input single-channel image, it is filtered as a whole
+/// \param roi, in - region to describe
+/// \param rank, in - see select_texture
+/// \return mean and standard deviation of every filter response in ROI
+std::vector<double> texture_descriptor(const cv::Mat& image, const cv::Rect& roi, int rank = 0);
 
 /// \brief Motion Segmentation algorithm
 class motion_segmentation : public cv::BackgroundSubtractor
@@ -69,22 +150,121 @@ class corner_detector_fast : public cv::Feature2D
     }
 };
 
-/// \brief Descriptor matched based on ratio of SSD
+class hamming_index;
+class descriptor_store;
+class match_queue;
+struct match_settings;
+
+/// \brief Descriptor matcher based on Hamming distance with optional ratio check
 class descriptor_matcher : public cv::DescriptorMatcher
 {
     public:
     /// \brief ctor
-    descriptor_matcher(float ratio = 1.5) : ratio_(ratio)
-    {
-    }
+    /// \param ratio, in - see set_ratio
+    descriptor_matcher(float ratio = 1);
+
+    /// \brief copies train descriptors and built search structure
+    descriptor_matcher(const descriptor_matcher& other);
 
-    /// \brief setup ratio threshold for SSD filtering
+    descriptor_matcher& operator=(const descriptor_matcher&) = delete;
+
+    /// \brief setup ratio check of k nearest and guided matching, radius matching gives all descriptors within the radius regardless of it
+    /// \param r, in - min ratio of distances to the second and the nearest train descriptors, query failed the check gets no matches;
+    ///                 value not greater than 1 disables the check
     void set_ratio(float r)
     {
         ratio_ = r;
     }
 
+    /// \brief setup max number of threads used for matching
+    /// \param n, in - number of threads, non-positive value means OpenCV default
+    void set_threads(int n)
+    {
+        threads_ = n;
+    }
+
+    /// \brief setup number of query descriptors matched together against each block of train descriptors
+    void set_batch_size(int n)
+    {
+        CV_Assert(n > 0);
+        batch_size_ = n;
+    }
+
+    /// \brief keep only mutual matches: the query has to be the nearest one for the matched train descriptor too
+    /// \details brute force finds the nearest queries in the same pass, search structures choose them among queries which found the train descriptor
+    void set_cross_check(bool enable)
+    {
+        cross_check_ = enable;
+    }
+
+    /// \brief compare queries with every train descriptor (default)
+    void use_brute_force();
+
+    /// \brief build multi-index hashing in train() for exact sub-linear search
+    /// \param substrings, in - number of hash tables, non-positive value means to choose it by the train set size
+    void use_multi_index_hashing(int substrings = 0);
+
+    /// \brief build randomized hierarchical clustering trees in train() for approximate search with bounded cost
+    /// \param trees, in - number of trees
+    /// \param branching, in - number of clusters (medoids) in every tree node
+    /// \param leaf_size, in - max number of descriptors in tree leaf
+    /// \param max_checks, in - max number of train descriptors compared with each query
+    void use_clustering_tree(int trees = 4, int branching = 32, int leaf_size = 100, int max_checks = 256);
+
+    /// \see cv::DescriptorMatcher::add
+    /// \details descriptors are copied into internal storage (getTrainDescriptors() stays empty)
+    ///          and appended to the built search structure without rebuilding it
+    virtual void add(cv::InputArrayOfArrays descriptors) override;
+
+    /// \see cv::DescriptorMatcher::empty
+    virtual bool empty() const override;
+
+    /// \brief remove train descriptor, it is never matched after that and the rest descriptors keep their indices
+    /// \param img_idx, in - index of train image
+    /// \param train_idx, in - index of descriptor in the train image
+    void remove(int img_idx, int train_idx);
+
+    /// \brief release memory of removed descriptors now instead of waiting for background compaction
+    void compact();
+
+    /// \brief match every query with the nearest train descriptor located around its position predicted by homography
+    /// \details ratio check compares the nearest descriptor with the second nearest one in the same window
+    /// \param query_keypoints, in - positions of query descriptors
+    /// \param queryDescriptors, in - query descriptors
+    /// \param train_keypoints, in - positions of train descriptors
+    /// \param trainDescriptors, in - train descriptors
+    /// \param homography, in - predicted transform of query positions into the train image
+    /// \param window, in - half size of square search window around predicted position
+    /// \param matches, out - the nearest match or empty vector for every query
+    /// \param maxDistance, in - threshold for distance between matched descriptors
+    void guided_match(const std::vector<cv::KeyPoint>& query_keypoints, cv::InputArray queryDescriptors,
+                      const std::vector<cv::KeyPoint>& train_keypoints, cv::InputArray trainDescriptors, const cv::Mat& homography, float window,
+                      std::vector<std::vector<cv::DMatch>>& matches, float maxDistance = std::numeric_limits<float>::max()) const;
+
+    /// \brief match every query with the nearest train descriptor located in its search window
+    /// \param windows, in - search window in the train image for every query
+    /// \see guided_match
+    void guided_match(cv::InputArray queryDescriptors, const std::vector<cv::KeyPoint>& train_keypoints, cv::InputArray trainDescriptors,
+                      const std::vector<cv::Rect2f>& windows, std::vector<std::vector<cv::DMatch>>& matches,
+                      float maxDistance = std::numeric_limits<float>::max()) const;
+
+    /// \brief queue query descriptors for k nearest matching in background, may be called concurrently from several threads
+    /// \details queued frames are matched together in one pass, so train descriptors are read once per several frames;
+    ///          train descriptors may be changed meanwhile, the other settings are copied into the frame by this call,
+    ///          setters must not be called concurrently with it
+    /// \return matches in the same format as knnMatch gives
+    std::future<std::vector<std::vector<cv::DMatch>>> submit(cv::InputArray queryDescriptors, int k = 1);
+
+    /// \see cv::DescriptorMatcher::clear
+    virtual void clear() override;
+
+    /// \see cv::DescriptorMatcher::train
+    virtual void train() override;
+
     protected:
+    /// \brief setup search structure built in train()
+    void use_index(const cv::Ptr<hamming_index>& index);
+
     /// \see cv::DescriptorMatcher::knnMatchImpl
     virtual void knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k,
                               cv::InputArrayOfArrays masks = cv::noArray(), bool compactResult = false) override;
@@ -96,7 +276,7 @@ class descriptor_matcher : public cv::DescriptorMatcher
     /// \see cv::DescriptorMatcher::isMaskSupported
     virtual bool isMaskSupported() const override
     {
-        return false;
+        return true;
     }
 
     /// \see cv::DescriptorMatcher::isMaskSupported
@@ -111,7 +291,44 @@ class descriptor_matcher : public cv::DescriptorMatcher
     }
 
     private:
+    /// \brief current settings of matching
+    match_settings settings() const;
+
+    /// \brief k nearest matching with given settings, the caller holds shared lock of the store
+    void knn_match(const cv::Mat& query, int k, const std::vector<cv::Mat>& masks, const match_settings& settings,
+                   std::vector<std::vector<cv::DMatch>>& matches) const;
+
     float ratio_;
+    int threads_ = 0;
+    int batch_size_ = 64;
+    bool cross_check_ = false;
+    cv::Ptr<descriptor_store> store_; //< train descriptors in matching order
+    cv::Ptr<hamming_index> index_; //< search structure, brute force is used if it is empty
+    bool index_outdated_ = true; //< the index has to be built in train()
+    std::once_flag queue_created_; //< concurrent first calls of submit() create the queue once
+    cv::Ptr<match_queue> queue_; //< workers of submit() are started on demand, they are stopped before the rest members are destroyed
+};
+
+/// \brief Approximate matcher based on multi-probe LSH of sampled descriptor bits
+class lsh_matcher : public descriptor_matcher
+{
+    public:
+    /// \brief ctor
+    /// \param tables, in - number of hash tables, more tables give better recall
+    /// \param key_size, in - number of sampled bits in hash key (up to 32), longer keys give smaller buckets
+    /// \param probe_level, in - max Hamming distance between query key and probed bucket keys
+    lsh_matcher(int tables = 8, int key_size = 16, int probe_level = 1);
+
+    /// \see cv::DescriptorMatcher::clone
+    virtual cv::Ptr<cv::DescriptorMatcher> clone(bool emptyTrainData = false) const override
+    {
+        cv::Ptr<cv::DescriptorMatcher> copy = new lsh_matcher(*this);
+        if (emptyTrainData)
+        {
+            copy->clear();
+        }
+        return copy;
+    }
 };
 
 /// \brief Stitcher for merging images into big one
@@ -0,0 +1,247 @@
+/* Hierarchical clustering trees for binary descriptors implementation.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include "hamming_index.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+namespace cvlib
+{
+cv::Ptr<hamming_index> clustering_index::create_empty() const
+{
+    return cv::makePtr<clustering_index>(trees_count_, branching_, leaf_size_, max_checks_);
+}
+
+cv::Ptr<hamming_index> clustering_index::clone(const descriptor_store& store) const
+{
+    auto copy = cv::makePtr<clustering_index>(*this);
+    copy->store_ = &store;
+    return copy;
+}
+
+void clustering_index::build(const descriptor_store& store)
+{
+    store_ = &store;
+    trees_.assign(trees_count_, {});
+
+    // trees differ by random medoids only, so they are built in parallel
+    cv::parallel_for_(cv::Range(0, trees_count_), [&](const cv::Range& range) {
+        for (auto i = range.start; i < range.end; ++i)
+        {
+            auto& t = trees_[i];
+            t.rng = cv::RNG(0x5eed + i);
+            t.nodes.push_back({-1, -1, 0, {}});
+            for (auto id = store.first(); id < store.size(); ++id)
+                if (store.alive(id))
+                    t.nodes[0].points.push_back(id);
+            split(t, 0);
+        }
+    });
+}
+
+void clustering_index::insert(int handle)
+{
+    for (auto& t : trees_)
+    {
+        const auto n = find_leaf(t, store_->row(handle));
+        t.nodes[n].points.push_back(handle);
+        split(t, n);
+    }
+}
+
+void clustering_index::erase(int handle)
+{
+    for (auto& t : trees_)
+    {
+        auto& points = t.nodes[find_leaf(t, store_->row(handle))].points;
+        const auto pos = std::find(points.begin(), points.end(), handle);
+        if (pos != points.end())
+        {
+            *pos = points.back();
+            points.pop_back();
+        }
+    }
+}
+
+int clustering_index::find_leaf(const tree& t, const uint8_t* desc) const
+{
+    // the nearest medoid is chosen the same way as points are assigned to clusters in split
+    const auto bytes = store_->bytes();
+    auto n = 0;
+    while (t.nodes[n].first_child >= 0)
+    {
+        auto best = -1;
+        auto best_dist = std::numeric_limits<int>::max();
+        for (auto c = t.nodes[n].first_child; c < t.nodes[n].first_child + t.nodes[n].child_count; ++c)
+        {
+            const auto d = hamming_distance(desc, t.pivots.data() + t.nodes[c].pivot * bytes, bytes, best_dist - 1);
+            if (d < best_dist)
+            {
+                best = c;
+                best_dist = d;
+            }
+        }
+        n = best;
+    }
+    return n;
+}
+
+void clustering_index::split(tree& t, int n) const
+{
+    const auto count = static_cast<int>(t.nodes[n].points.size());
+    if (count <= leaf_size_)
+        return;
+
+    // k-medoids++ seeding: every next medoid is chosen with probability proportional to distance to the nearest chosen one
+    const auto bytes = store_->bytes();
+    const auto& points = t.nodes[n].points;
+    std::vector<int> medoids = {points[t.rng.uniform(0, count)]};
+    std::vector<int> dist(count);
+    std::vector<int> label(count, 0);
+    for (auto i = 0; i < count; ++i)
+        dist[i] = hamming_distance(store_->row(points[i]), store_->row(medoids[0]), bytes, std::numeric_limits<int>::max());
+
+    while (medoids.size() < static_cast<size_t>(branching_))
+    {
+        int64_t total = 0;
+        for (auto d : dist)
+            total += d;
+        if (total == 0)
+            break; // the rest points duplicate chosen medoids
+
+        auto pick = static_cast<int64_t>(t.rng.uniform(0., 1.) * total);
+        auto chosen = 0;
+        while (chosen < count - 1 && pick >= dist[chosen])
+            pick -= dist[chosen++];
+
+        const auto medoid = points[chosen];
+        const auto c = static_cast<int>(medoids.size());
+        medoids.push_back(medoid);
+        for (auto i = 0; i < count; ++i)
+        {
+            const auto d = hamming_distance(store_->row(points[i]), store_->row(medoid), bytes, dist[i] - 1);
+            if (d < dist[i])
+            {
+                dist[i] = d;
+                label[i] = c;
+            }
+        }
+    }
+
+    const auto clusters = static_cast<int>(medoids.size());
+    if (clusters < 2)
+        return;
+
+    const auto first_child = static_cast<int>(t.nodes.size());
+    for (auto c = 0; c < clusters; ++c)
+    {
+        const auto pivot = static_cast<int>(t.pivots.size()) / bytes;
+        const auto row = store_->row(medoids[c]);
+        t.pivots.insert(t.pivots.end(), row, row + bytes);
+        t.nodes.push_back({pivot, -1, 0, {}});
+    }
+    // points of the parent are distributed among the children
+    auto parent_points = std::move(t.nodes[n].points);
+    t.nodes[n].points.clear();
+    t.nodes[n].first_child = first_child;
+    t.nodes[n].child_count = clusters;
+    for (auto i = 0; i < count; ++i)
+        t.nodes[first_child + label[i]].points.push_back(parent_points[i]);
+    for (auto c = 0; c < clusters; ++c)
+        split(t, first_child + c);
+}
+
+template <typename Visitor>
+void clustering_index::traverse(const uint8_t* query, Visitor&& visit) const
+{
+    // unexplored branches ordered by distance from the query to their medoids
+    using branch = std::pair<int, std::pair<int, int>>; // (distance, (tree, node))
+    std::priority_queue<branch, std::vector<branch>, std::greater<branch>> queue;
+
+    auto checks = 0;
+    const auto bytes = store_->bytes();
+    const auto descend = [&](int ti, int n) {
+        const auto& t = trees_[ti];
+        while (t.nodes[n].first_child >= 0)
+        {
+            auto best = -1;
+            auto best_dist = std::numeric_limits<int>::max();
+            for (auto c = t.nodes[n].first_child; c < t.nodes[n].first_child + t.nodes[n].child_count; ++c)
+            {
+                const auto d = hamming_distance(query, t.pivots.data() + t.nodes[c].pivot * bytes, bytes, std::numeric_limits<int>::max());
+                if (d < best_dist)
+                {
+                    if (best >= 0)
+                        queue.push({best_dist, {ti, best}});
+                    best = c;
+                    best_dist = d;
+                }
+                else
+                {
+                    queue.push({d, {ti, c}});
+                }
+            }
+            n = best;
+        }
+
+        for (auto id : t.nodes[n].points)
+            checks += visit(id);
+    };
+
+    for (auto ti = 0; ti < trees_count_; ++ti)
+        descend(ti, 0);
+    while (!queue.empty() && checks < max_checks_)
+    {
+        const auto b = queue.top();
+        queue.pop();
+        descend(b.second.first, b.second.second);
+    }
+}
+
+void clustering_index::knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || k <= 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    traverse(query, [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return false;
+        const auto limit = s.nearest_limit(k);
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), limit);
+        if (dist <= limit)
+            s.keep_nearest(k, dist, id);
+        return true;
+    });
+
+    store_->to_matches(s.found, result);
+}
+
+void clustering_index::radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || max_dist < 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    traverse(query, [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return false;
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), max_dist);
+        if (dist <= max_dist)
+            s.found.emplace_back(dist, id);
+        return true;
+    });
+
+    std::sort(s.found.begin(), s.found.end());
+    store_->to_matches(s.found, result);
+}
+} // namespace cvlib
@@ -5,50 +5,842 @@
  */
 
 #include "cvlib.hpp"
+#include "hamming_index.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+/// \brief Number of train descriptors compared with a batch of queries while they stay in cache
+const int train_block_rows = 512;
+
+/// \brief Number of threads matching frames queued by submit(), every pass is parallel itself
+const int async_workers = 2;
+
+/// \brief Keeps k nearest train descriptors of a single query sorted by distance
+struct knn_collector
+{
+    int k;
+    std::vector<std::pair<int, int>> best; //< (distance, handle)
+
+    explicit knn_collector(int k) : k(k)
+    {
+    }
+
+    void reset()
+    {
+        best.clear();
+    }
+
+    /// \brief candidates with greater distance can't get into the result
+    int limit() const
+    {
+        return best.size() < static_cast<size_t>(k) ? std::numeric_limits<int>::max() : best.back().first - 1;
+    }
+
+    /// \brief the query may be the nearest one for the train row even if the row doesn't get into the result
+    int cross_check_limit(int train_nearest) const
+    {
+        return std::max(limit(), train_nearest);
+    }
+
+    void push(int handle, int dist)
+    {
+        const std::pair<int, int> m(dist, handle);
+        best.insert(std::upper_bound(best.begin(), best.end(), m), m);
+        if (best.size() > static_cast<size_t>(k))
+            best.pop_back();
+    }
+
+    void flush(int query_idx, const cvlib::descriptor_store& store, std::vector<cv::DMatch>& out)
+    {
+        store.to_matches(best, out);
+        for (auto& m : out)
+            m.queryIdx = query_idx;
+    }
+};
+
+/// \brief Keeps all train descriptors of a single query within the radius
+struct radius_collector
+{
+    int max_dist;
+    std::vector<std::pair<int, int>> found; //< (distance, handle)
+
+    explicit radius_collector(int max_dist) : max_dist(max_dist)
+    {
+    }
+
+    void reset()
+    {
+        found.clear();
+    }
+
+    int limit() const
+    {
+        return max_dist;
+    }
+
+    /// \brief farther queries can't be matched with the train row at all
+    int cross_check_limit(int) const
+    {
+        return max_dist;
+    }
+
+    void push(int handle, int dist)
+    {
+        found.emplace_back(dist, handle);
+    }
+
+    void flush(int query_idx, const cvlib::descriptor_store& store, std::vector<cv::DMatch>& out)
+    {
+        // handles follow train order, so ties keep it
+        std::sort(found.begin(), found.end());
+        store.to_matches(found, out);
+        for (auto& m : out)
+            m.queryIdx = query_idx;
+    }
+};
+
+/// \brief Nearest query of every train row for cross-check, it is updated concurrently by all workers
+class nearest_queries
+{
+    public:
+    /// \param first, in - the first train row
+    /// \param end, in - the row after the last one
+    nearest_queries(int first, int end) : first_(first), best_(end - first)
+    {
+        for (auto& b : best_)
+            b.store(pack(std::numeric_limits<int>::max(), -1), std::memory_order_relaxed);
+    }
+
+    /// \brief distance to the nearest query found so far
+    int distance(int handle) const
+    {
+        return static_cast<int>(best_[handle - first_].load(std::memory_order_relaxed) >> 32);
+    }
+
+    /// \brief atomic min of (distance, query) pair, so ties are resolved the same way regardless of threads
+    void update(int handle, int dist, int query)
+    {
+        const auto candidate = pack(dist, query);
+        auto& best = best_[handle - first_];
+        auto current = best.load(std::memory_order_relaxed);
+        while (candidate < current && !best.compare_exchange_weak(current, candidate, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /// \brief drops matches whose query is not the nearest one for the train row
+    /// \param handle, in - functor which gives train row of match
+    template <typename Handle>
+    void keep_mutual(Handle handle, std::vector<std::vector<cv::DMatch>>& matches) const
+    {
+        for (auto& query_matches : matches)
+        {
+            const auto not_mutual = [&](const cv::DMatch& m) {
+                return best_[handle(m) - first_].load(std::memory_order_relaxed) != pack(static_cast<int>(m.distance), m.queryIdx);
+            };
+            query_matches.erase(std::remove_if(query_matches.begin(), query_matches.end(), not_mutual), query_matches.end());
+        }
+    }
+
+    private:
+    static uint64_t pack(int dist, int query)
+    {
+        return (static_cast<uint64_t>(dist) << 32) | static_cast<uint32_t>(query);
+    }
+
+    int first_;
+    std::vector<std::atomic<uint64_t>> best_;
+};
+
+/// \brief Max distance of matched descriptors, distances are integer, so "dist < max_distance" is the same as "dist <= limit"
+int distance_limit(float max_distance)
+{
+    return max_distance > std::numeric_limits<int>::max() ? std::numeric_limits<int>::max() : static_cast<int>(std::ceil(max_distance)) - 1;
+}
+
+/// \brief Uniform grid over keypoints, indices of keypoints of every cell are stored together
+class keypoint_grid
+{
+    public:
+    /// \param cell, in - cell size, it is increased if the grid gets too many cells
+    keypoint_grid(const std::vector<cv::KeyPoint>& keypoints, float cell)
+    {
+        if (keypoints.empty())
+            return;
+
+        auto tl = keypoints[0].pt;
+        auto br = keypoints[0].pt;
+        for (const auto& kp : keypoints)
+        {
+            tl = cv::Point2f(std::min(tl.x, kp.pt.x), std::min(tl.y, kp.pt.y));
+            br = cv::Point2f(std::max(br.x, kp.pt.x), std::max(br.y, kp.pt.y));
+        }
+        const auto max_cells = 1024.f;
+        origin_ = tl;
+        cell_ = std::max({cell, 1.f, (br.x - tl.x) / max_cells, (br.y - tl.y) / max_cells});
+        cols_ = static_cast<int>((br.x - tl.x) / cell_) + 1;
+        rows_ = static_cast<int>((br.y - tl.y) / cell_) + 1;
+
+        // counting sort of keypoints by cells
+        starts_.assign(cols_ * rows_ + 1, 0);
+        std::vector<int> cells(keypoints.size());
+        for (size_t i = 0; i < keypoints.size(); ++i)
+        {
+            cells[i] = cell_of(keypoints[i].pt.y, rows_, origin_.y) * cols_ + cell_of(keypoints[i].pt.x, cols_, origin_.x);
+            ++starts_[cells[i] + 1];
+        }
+        for (size_t c = 1; c < starts_.size(); ++c)
+            starts_[c] += starts_[c - 1];
+        points_.resize(keypoints.size());
+        auto next = starts_;
+        for (size_t i = 0; i < keypoints.size(); ++i)
+            points_[next[cells[i]]++] = static_cast<int>(i);
+    }
+
+    /// \brief calls f for keypoints of all cells intersecting the window
+    template <typename F>
+    void for_each(const cv::Rect2f& window, F&& f) const
+    {
+        if (points_.empty() || window.x + window.width < origin_.x || window.y + window.height < origin_.y || window.x > origin_.x + cols_ * cell_ ||
+            window.y > origin_.y + rows_ * cell_)
+            return;
+        const auto x_end = cell_of(window.x + window.width, cols_, origin_.x);
+        const auto y_end = cell_of(window.y + window.height, rows_, origin_.y);
+        for (auto y = cell_of(window.y, rows_, origin_.y); y <= y_end; ++y)
+            for (auto c = y * cols_ + cell_of(window.x, cols_, origin_.x); c <= y * cols_ + x_end; ++c)
+                for (auto i = starts_[c]; i < starts_[c + 1]; ++i)
+                    f(points_[i]);
+    }
+
+    private:
+    /// \brief cell index along the axis clamped to the grid
+    int cell_of(float v, int count, float origin) const
+    {
+        return static_cast<int>(std::min(std::max((v - origin) / cell_, 0.f), count - 1.f));
+    }
+
+    cv::Point2f origin_;
+    float cell_ = 1;
+    int cols_ = 0;
+    int rows_ = 0;
+    std::vector<int> starts_; //< first keypoint of every cell in points
+    std::vector<int> points_;
+};
+
+/// \brief Position of the point transformed by homography
+cv::Point2f predict(const cv::Mat& h, cv::Point2f p)
+{
+    const auto w = h.at<double>(2, 0) * p.x + h.at<double>(2, 1) * p.y + h.at<double>(2, 2);
+    const auto x = h.at<double>(0, 0) * p.x + h.at<double>(0, 1) * p.y + h.at<double>(0, 2);
+    const auto y = h.at<double>(1, 0) * p.x + h.at<double>(1, 1) * p.y + h.at<double>(1, 2);
+    return std::abs(w) > 1e-12 ? cv::Point2f(static_cast<float>(x / w), static_cast<float>(y / w)) : cv::Point2f(-1e9f, -1e9f);
+}
+
+/// \brief Checks that train descriptors and masks fit the query descriptors
+void check_input(const cv::Mat& q_desc, const cvlib::descriptor_store& store, const std::vector<cv::Mat>& masks)
+{
+    CV_Assert(q_desc.type() == CV_8UC1);
+    CV_Assert(store.bytes() == 0 || store.bytes() == q_desc.cols);
+    CV_Assert(masks.empty() || static_cast<int>(masks.size()) == store.images());
+    for (size_t img = 0; img < masks.size(); ++img)
+    {
+        const auto& m = masks[img];
+        CV_Assert(m.empty() || (m.type() == CV_8UC1 && m.rows == q_desc.rows && m.cols == store.image_rows(static_cast<int>(img))));
+    }
+}
+
+/// \brief Mask row of the query for the train image, nullptr if all image rows are allowed
+inline const uint8_t* mask_row(const std::vector<cv::Mat>& masks, int img, int query)
+{
+    return masks.empty() || masks[img].empty() ? nullptr : masks[img].ptr<uint8_t>(query);
+}
+
+/// \brief Mask rows of the query for all train images or empty vector if nothing is masked
+void fill_query_mask(const std::vector<cv::Mat>& masks, bool masked, int query, cvlib::query_mask& mask)
+{
+    mask.clear();
+    for (auto img = 0; masked && img < static_cast<int>(masks.size()); ++img)
+        mask.push_back(mask_row(masks, img, query));
+}
+
+/// \brief Blocked brute force matching parallelized over batches of query rows
+/// \param masks, in - masks for every train image or empty vector
+/// \param batch_size, in - number of queries compared against each block of train descriptors
+/// \param threads, in - max number of concurrently processed stripes, non-positive value means OpenCV default
+/// \param proto, in - collector which is copied into per-thread result buffers
+/// \param nearest, in/out - nearest query of every train row updated in the same pass or nullptr if cross-check is off
+template <typename Collector>
+void match_blocked(const cv::Mat& q_desc, const cvlib::descriptor_store& store, const std::vector<cv::Mat>& masks, int batch_size, int threads,
+                   const Collector& proto, nearest_queries* nearest, std::vector<std::vector<cv::DMatch>>& matches)
+{
+    check_input(q_desc, store, masks);
+    const auto masked = std::any_of(masks.begin(), masks.end(), [](const cv::Mat& m) { return !m.empty(); });
+
+    // every query owns its slot, so workers fill the result without any locking
+    matches.assign(q_desc.rows, std::vector<cv::DMatch>());
+
+    const auto batches = (q_desc.rows + batch_size - 1) / batch_size;
+    auto body = [&](const cv::Range& range) {
+        std::vector<Collector> buffer(batch_size, proto);
+        std::vector<cvlib::query_mask> mask(batch_size);
+        for (auto b = range.start; b < range.end; ++b)
+        {
+            const auto q_begin = b * batch_size;
+            const auto q_end = std::min(q_begin + batch_size, q_desc.rows);
+            for (auto i = q_begin; i < q_end; ++i)
+            {
+                buffer[i - q_begin].reset();
+                fill_query_mask(masks, masked, i, mask[i - q_begin]);
+            }
+
+            for (const auto& block : store.blocks())
+            {
+                if (block.alive == 0)
+                    continue;
+
+                const auto rows = static_cast<int>(block.handles.size());
+                for (auto i = q_begin; i < q_end; ++i)
+                {
+                    // the whole block is skipped if it keeps rows of single image masked out for the query
+                    const auto& m = mask[i - q_begin];
+                    const auto img_mask = block.img >= 0 && !m.empty() ? m[block.img] : nullptr;
+                    if (img_mask && std::none_of(img_mask + block.first_train, img_mask + block.last_train + 1, [](uint8_t v) { return v != 0; }))
+                        continue;
+
+                    auto& c = buffer[i - q_begin];
+                    const auto q_row = q_desc.ptr<uint8_t>(i);
+                    for (auto j = 0; j < rows; ++j)
+                    {
+                        const auto h = block.handles[j];
+                        if (!store.alive(h) || !store.allowed(m, h))
+                            continue;
+                        const auto limit = nearest ? c.cross_check_limit(nearest->distance(h)) : c.limit();
+                        const auto dist = cvlib::hamming_distance(q_row, block.data.ptr<uint8_t>(j), q_desc.cols, limit);
+                        if (dist > limit)
+                            continue;
+                        if (nearest)
+                            nearest->update(h, dist, i);
+                        if (dist <= c.limit())
+                            c.push(h, dist);
+                    }
+                }
+            }
+
+            for (auto i = q_begin; i < q_end; ++i)
+                buffer[i - q_begin].flush(i, store, matches[i]);
+        }
+    };
+    cv::parallel_for_(cv::Range(0, batches), body, threads > 0 ? threads : -1.);
+}
+
+/// \brief Matching with search structure parallelized over query rows
+/// \param masks, in - masks for every train image or empty vector
+/// \param search, in - functor which finds train descriptors for a single query
+/// \param nearest, in/out - nearest query of every found train row or nullptr if cross-check is off
+template <typename Search>
+void match_indexed(const cv::Mat& q_desc, const cvlib::descriptor_store& store, const std::vector<cv::Mat>& masks, int threads, Search search,
+                   nearest_queries* nearest, std::vector<std::vector<cv::DMatch>>& matches)
+{
+    check_input(q_desc, store, masks);
+    const auto masked = std::any_of(masks.begin(), masks.end(), [](const cv::Mat& m) { return !m.empty(); });
+
+    matches.assign(q_desc.rows, std::vector<cv::DMatch>());
+    auto body = [&](const cv::Range& range) {
+        cvlib::query_mask mask;
+        for (auto i = range.start; i < range.end; ++i)
+        {
+            fill_query_mask(masks, masked, i, mask);
+            search(q_desc.ptr<uint8_t>(i), mask, matches[i]);
+            for (auto& m : matches[i])
+            {
+                m.queryIdx = i;
+                if (nearest)
+                    nearest->update(store.handle(m.imgIdx, m.trainIdx), static_cast<int>(m.distance), i);
+            }
+        }
+    };
+    cv::parallel_for_(cv::Range(0, q_desc.rows), body, threads > 0 ? threads : -1.);
+}
+
+void compact_result(std::vector<std::vector<cv::DMatch>>& matches)
+{
+    matches.erase(std::remove_if(matches.begin(), matches.end(), [](const std::vector<cv::DMatch>& m) { return m.empty(); }), matches.end());
+}
+} // namespace
 
 namespace cvlib
 {
-void descriptor_matcher::knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k /*unhandled*/,
-                                      cv::InputArrayOfArrays masks /*unhandled*/, bool compactResult /*unhandled*/)
+/// \brief Settings of k nearest matching, frames queued by descriptor_matcher::submit keep the settings of the call
+struct match_settings
+{
+    float ratio;
+    int threads;
+    int batch_size;
+    bool cross_check;
+
+    bool operator==(const match_settings& other) const
+    {
+        return ratio == other.ratio && threads == other.threads && batch_size == other.batch_size && cross_check == other.cross_check;
+    }
+};
+
+/// \brief Frames queued by descriptor_matcher::submit and workers which match them in batches
+class match_queue
+{
+    public:
+    struct frame
+    {
+        cv::Mat query;
+        int k;
+        match_settings settings;
+        std::promise<std::vector<std::vector<cv::DMatch>>> result;
+    };
+
+    /// \brief ctor
+    /// \param workers, in - number of worker threads
+    /// \param match, in - functor which matches a batch of frames with the same k and settings and fulfills their promises
+    match_queue(int workers, std::function<void(std::vector<frame>&)> match) : match_(std::move(match))
+    {
+        for (auto i = 0; i < workers; ++i)
+            workers_.emplace_back([this] { work(); });
+    }
+
+    /// \brief matches the rest of queued frames and stops workers
+    ~match_queue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for (auto& w : workers_)
+            w.join();
+    }
+
+    std::future<std::vector<std::vector<cv::DMatch>>> push(const cv::Mat& query, int k, const match_settings& settings)
+    {
+        frame f;
+        f.query = query;
+        f.k = k;
+        f.settings = settings;
+        auto result = f.result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            frames_.push_back(std::move(f));
+        }
+        ready_.notify_one();
+        return result;
+    }
+
+    private:
+    void work()
+    {
+        std::vector<frame> batch;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stop_ || !frames_.empty(); });
+                if (frames_.empty())
+                    return;
+
+                // all queued frames with the same k and settings are taken while the batch is not too big
+                const auto k = frames_.front().k;
+                const auto settings = frames_.front().settings;
+                auto rows = 0;
+                for (auto f = frames_.begin(); f != frames_.end() && rows < max_batch_rows;)
+                {
+                    if (f->k != k || !(f->settings == settings))
+                    {
+                        ++f;
+                        continue;
+                    }
+                    rows += f->query.rows;
+                    batch.push_back(std::move(*f));
+                    f = frames_.erase(f);
+                }
+            }
+
+            match_(batch);
+            batch.clear();
+        }
+    }
+
+    static const int max_batch_rows = 16384;
+
+    std::function<void(std::vector<frame>&)> match_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<frame> frames_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+descriptor_matcher::descriptor_matcher(float ratio) : ratio_(ratio), store_(cv::makePtr<descriptor_store>())
+{
+}
+
+descriptor_matcher::descriptor_matcher(const descriptor_matcher& other)
+    : cv::DescriptorMatcher(other), ratio_(other.ratio_), threads_(other.threads_), batch_size_(other.batch_size_), cross_check_(other.cross_check_),
+      store_(other.store_->clone()), index_(other.index_), index_outdated_(other.index_outdated_)
+{
+    if (index_ && !index_outdated_)
+        index_ = other.index_->clone(*store_);
+}
+
+void descriptor_matcher::use_brute_force()
+{
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    index_.reset();
+}
+
+void descriptor_matcher::use_multi_index_hashing(int substrings)
+{
+    use_index(cv::makePtr<mih_index>(substrings));
+}
+
+void descriptor_matcher::use_clustering_tree(int trees, int branching, int leaf_size, int max_checks)
+{
+    use_index(cv::makePtr<clustering_index>(trees, branching, leaf_size, max_checks));
+}
+
+void descriptor_matcher::use_index(const cv::Ptr<hamming_index>& index)
+{
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    index_ = index;
+    index_outdated_ = true;
+}
+
+void descriptor_matcher::add(cv::InputArrayOfArrays descriptors)
+{
+    // the store copies descriptors, so trainDescCollection is left empty and removed rows don't keep memory
+    std::vector<cv::Mat> images;
+    if (descriptors.isMatVector() || descriptors.isUMatVector())
+        descriptors.getMatVector(images);
+    else
+        images.push_back(descriptors.getMat());
+
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    for (const auto& image : images)
+    {
+        const auto first = store_->append(image);
+        for (auto h = first; index_ && !index_outdated_ && h < store_->size(); ++h)
+            index_->insert(h);
+    }
+}
+
+bool descriptor_matcher::empty() const
+{
+    std::shared_lock<std::shared_mutex> lock(store_->mutex());
+    return store_->images() == 0;
+}
+
+void descriptor_matcher::remove(int img_idx, int train_idx)
+{
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    const auto h = store_->handle(img_idx, train_idx);
+    if (!store_->alive(h))
+        return;
+
+    // the index finds the row by its descriptor, so it goes first
+    if (index_ && !index_outdated_)
+        index_->erase(h);
+    store_->erase(h);
+}
+
+void descriptor_matcher::compact()
+{
+    store_->compact();
+}
+
+void descriptor_matcher::clear()
 {
-    if (trainDescCollection.empty())
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    cv::DescriptorMatcher::clear();
+    store_->clear();
+    index_outdated_ = true;
+}
+
+void descriptor_matcher::train()
+{
+    std::unique_lock<std::shared_mutex> lock(store_->mutex());
+    if (!index_ || !index_outdated_ || store_->alive_count() == 0)
         return;
 
-    auto q_desc = queryDescriptors.getMat();
-    auto& t_desc = trainDescCollection[0];
+    // index may be shared with clones of this matcher, so it is never rebuilt in place
+    auto index = index_->create_empty();
+    index->build(*store_);
+    index_ = index;
+    index_outdated_ = false;
+}
+
+void descriptor_matcher::guided_match(const std::vector<cv::KeyPoint>& query_keypoints, cv::InputArray queryDescriptors,
+                                      const std::vector<cv::KeyPoint>& train_keypoints, cv::InputArray trainDescriptors, const cv::Mat& homography,
+                                      float window, std::vector<std::vector<cv::DMatch>>& matches, float maxDistance) const
+{
+    CV_Assert(homography.rows == 3 && homography.cols == 3 && window >= 0);
+    cv::Mat h;
+    homography.convertTo(h, CV_64F);
+
+    std::vector<cv::Rect2f> windows;
+    for (const auto& kp : query_keypoints)
+    {
+        const auto p = predict(h, kp.pt);
+        windows.emplace_back(p.x - window, p.y - window, 2 * window, 2 * window);
+    }
+    guided_match(queryDescriptors, train_keypoints, trainDescriptors, windows, matches, maxDistance);
+}
 
-    matches.resize(q_desc.rows);
+void descriptor_matcher::guided_match(cv::InputArray queryDescriptors, const std::vector<cv::KeyPoint>& train_keypoints,
+                                      cv::InputArray trainDescriptors, const std::vector<cv::Rect2f>& windows,
+                                      std::vector<std::vector<cv::DMatch>>& matches, float maxDistance) const
+{
+    const auto q_desc = queryDescriptors.getMat();
+    const auto t_desc = trainDescriptors.getMat();
+    CV_Assert(q_desc.type() == CV_8UC1 && static_cast<int>(windows.size()) == q_desc.rows);
+    CV_Assert(t_desc.empty() || (t_desc.type() == CV_8UC1 && t_desc.cols == q_desc.cols));
+    CV_Assert(static_cast<int>(train_keypoints.size()) == t_desc.rows);
 
-    auto distance = [](const cv::Mat q_desc, const cv::Mat t_desc) {
-        auto dist = 0;
-        for (auto i = 0; i < q_desc.cols; ++i) {
-            const auto q_desc_b = q_desc.at<uint8_t>(0, i);
-            const auto t_desc_b = t_desc.at<uint8_t>(0, i);
+    matches.assign(q_desc.rows, std::vector<cv::DMatch>());
+    if (t_desc.empty())
+        return;
 
-            for (auto diff = q_desc_b ^ t_desc_b; diff > 0; diff >>= 1)
-                if (diff & 0x1)
-                    ++dist;
+    // cells of typical window size make every window cover a few cells only
+    auto cell = 0.f;
+    for (const auto& w : windows)
+        cell += std::max(w.width, w.height) / windows.size();
+    const keypoint_grid grid(train_keypoints, cell);
+
+    const auto limit = distance_limit(maxDistance);
+    const auto ratio_check = ratio_ > 1;
+    std::unique_ptr<nearest_queries> nearest(cross_check_ ? new nearest_queries(0, t_desc.rows) : nullptr);
+    cv::parallel_for_(cv::Range(0, q_desc.rows), [&](const cv::Range& range) {
+        for (auto i = range.start; i < range.end; ++i)
+        {
+            const auto q_row = q_desc.ptr<uint8_t>(i);
+            std::pair<int, int> best(limit, -1); // ties are resolved by train index like in brute force
+            auto second = std::numeric_limits<int>::max(); // distance to the second nearest descriptor in window
+            grid.for_each(windows[i], [&](int j) {
+                if (!windows[i].contains(train_keypoints[j].pt))
+                    return;
+                // farther descriptors can not make the nearest one ambiguous, so they are rejected by distance limit as well
+                const auto bound = !ratio_check ? best.first : ratio_ * best.first < limit ? static_cast<int>(ratio_ * best.first) : limit;
+                const auto j_limit = nearest ? std::max(bound, nearest->distance(j)) : bound;
+                const auto dist = hamming_distance(q_row, t_desc.ptr<uint8_t>(j), q_desc.cols, j_limit);
+                if (dist > j_limit)
+                    return;
+                if (nearest)
+                    nearest->update(j, dist, i);
+                if (dist <= best.first && (best.second < 0 || std::make_pair(dist, j) < best))
+                {
+                    if (best.second >= 0)
+                        second = best.first;
+                    best = std::make_pair(dist, j);
+                }
+                else
+                {
+                    second = std::min(second, dist);
+                }
+            });
+            if (best.second >= 0 && !(ratio_check && second < ratio_ * best.first))
+                matches[i].emplace_back(i, best.second, 0, static_cast<float>(best.first));
         }
-        return dist;
-    };
+    }, threads_ > 0 ? threads_ : -1.);
+
+    if (nearest)
+        nearest->keep_mutual([](const cv::DMatch& m) { return m.trainIdx; }, matches);
+}
+
+lsh_matcher::lsh_matcher(int tables, int key_size, int probe_level)
+{
+    use_index(cv::makePtr<lsh_index>(tables, key_size, probe_level));
+}
+
+std::future<std::vector<std::vector<cv::DMatch>>> descriptor_matcher::submit(cv::InputArray queryDescriptors, int k)
+{
+    const auto query = queryDescriptors.getMat().clone();
+    CV_Assert(query.type() == CV_8UC1 && k > 0);
+    train();
+
+    // streams may share the matcher, so several threads can make the first call at once
+    std::call_once(queue_created_, [this] {
+        queue_ = cv::makePtr<match_queue>(async_workers, [this](std::vector<match_queue::frame>& frames) {
+            // promise of every frame is fulfilled once, so frames done before an error keep their results
+            std::vector<bool> done(frames.size(), false);
+            const auto fail = [&](size_t f, std::exception_ptr error) {
+                frames[f].result.set_exception(error);
+                done[f] = true;
+            };
+
+            try
+            {
+                std::shared_lock<std::shared_mutex> lock(store_->mutex());
+
+                // frames are stacked into one matrix, so they have to be of the same width as train descriptors
+                const auto width = store_->bytes() > 0 ? store_->bytes() : frames.front().query.cols;
+                std::vector<size_t> valid;
+                for (size_t f = 0; f < frames.size(); ++f)
+                {
+                    try
+                    {
+                        CV_Assert(frames[f].query.empty() || frames[f].query.cols == width);
+                        valid.push_back(f);
+                    }
+                    catch (...)
+                    {
+                        fail(f, std::current_exception());
+                    }
+                }
+
+                // cross-check is done for every frame separately, the other frames are matched in one pass over train descriptors
+                const auto& settings = frames.front().settings;
+                const auto passes = settings.cross_check ? valid.size() : std::min<size_t>(valid.size(), 1);
+                for (size_t p = 0; p < passes; ++p)
+                {
+                    const auto first = valid.begin() + p;
+                    const auto last = settings.cross_check ? first + 1 : valid.end();
+                    auto rows = 0;
+                    for (auto f = first; f != last; ++f)
+                        rows += frames[*f].query.rows;
+
+                    cv::Mat all(rows, width, CV_8UC1);
+                    rows = 0;
+                    for (auto f = first; f != last; ++f)
+                    {
+                        const auto& query = frames[*f].query;
+                        if (!query.empty())
+                            query.copyTo(all.rowRange(rows, rows + query.rows));
+                        rows += query.rows;
+                    }
 
-    cv::RNG rnd;
-    for (int i = 0; i < q_desc.rows; ++i)
+                    std::vector<std::vector<cv::DMatch>> matches(all.rows);
+                    if (store_->alive_count() > 0 && all.rows > 0)
+                        knn_match(all, frames[*first].k, std::vector<cv::Mat>(), settings, matches);
+
+                    rows = 0;
+                    for (auto f = first; f != last; ++f)
+                    {
+                        const auto query_rows = frames[*f].query.rows;
+                        std::vector<std::vector<cv::DMatch>> result(matches.begin() + rows, matches.begin() + rows + query_rows);
+                        for (auto& query_matches : result)
+                            for (auto& m : query_matches)
+                                m.queryIdx -= rows;
+                        rows += query_rows;
+                        frames[*f].result.set_value(std::move(result));
+                        done[*f] = true;
+                    }
+                }
+            }
+            catch (...)
+            {
+                for (size_t f = 0; f < frames.size(); ++f)
+                    if (!done[f])
+                        fail(f, std::current_exception());
+            }
+        });
+    });
+
+    // settings are read by workers without locks, so every frame takes their copy
+    return queue_->push(query, k, settings());
+}
+
+match_settings descriptor_matcher::settings() const
+{
+    return match_settings{ratio_, threads_, batch_size_, cross_check_};
+}
+
+void descriptor_matcher::knn_match(const cv::Mat& query, int k, const std::vector<cv::Mat>& masks, const match_settings& settings,
+                                   std::vector<std::vector<cv::DMatch>>& matches) const
+{
+    std::unique_ptr<nearest_queries> nearest(settings.cross_check ? new nearest_queries(store_->first(), store_->size()) : nullptr);
+
+    // ratio check needs the second nearest descriptor even if only the nearest one is asked
+    const auto ratio_check = settings.ratio > 1;
+    const auto search_k = ratio_check ? std::max(k, 2) : k;
+
+    // the index is outdated after clear() or switching the search structure until train() is called, brute force works meanwhile
+    if (index_ && !index_outdated_)
+    {
+        const auto search = [&](const uint8_t* q, const query_mask& mask, std::vector<cv::DMatch>& result) {
+            index_->knn_search(q, search_k, mask, result);
+        };
+        match_indexed(query, *store_, masks, settings.threads, search, nearest.get(), matches);
+    }
+    else
+    {
+        match_blocked(query, *store_, masks, settings.batch_size, settings.threads, knn_collector(search_k), nearest.get(), matches);
+    }
+
+    if (ratio_check)
     {
-        // \todo implement Ratio of SSD check.
-                for (auto j = 0; j < t_desc.rows; ++j)
+        // ambiguous queries whose second nearest descriptor is almost as close as the nearest one are not matched at all
+        for (auto& query_matches : matches)
         {
-            auto dist = distance(q_desc.row(i), t_desc.row(i));
-            if (dist < this->ratio_)
-                matches[i].emplace_back(i, j, dist);
+            if (query_matches.size() > 1 && query_matches[1].distance < settings.ratio * query_matches[0].distance)
+                query_matches.clear();
+            else if (query_matches.size() > static_cast<size_t>(k))
+                query_matches.resize(k);
         }
     }
+
+    if (nearest)
+        nearest->keep_mutual([&](const cv::DMatch& m) { return store_->handle(m.imgIdx, m.trainIdx); }, matches);
+}
+
+void descriptor_matcher::knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k,
+                                      cv::InputArrayOfArrays masks, bool compactResult)
+{
+    matches.clear();
+    std::shared_lock<std::shared_mutex> lock(store_->mutex());
+    if (store_->alive_count() == 0)
+        return;
+
+    std::vector<cv::Mat> mask_collection;
+    masks.getMatVector(mask_collection);
+    knn_match(queryDescriptors.getMat(), k, mask_collection, settings(), matches);
+
+    if (compactResult)
+        compact_result(matches);
 }
 
-void descriptor_matcher::radiusMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, float /*maxDistance*/,
-                                         cv::InputArrayOfArrays masks /*unhandled*/, bool compactResult /*unhandled*/)
+void descriptor_matcher::radiusMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, float maxDistance,
+                                         cv::InputArrayOfArrays masks, bool compactResult)
 {
-    // \todo implement matching with "maxDistance"
-    knnMatchImpl(queryDescriptors, matches, 1, masks, compactResult);
+    matches.clear();
+    std::shared_lock<std::shared_mutex> lock(store_->mutex());
+    if (store_->alive_count() == 0)
+        return;
+
+    const auto limit = distance_limit(maxDistance);
+    std::vector<cv::Mat> mask_collection;
+    masks.getMatVector(mask_collection);
+    std::unique_ptr<nearest_queries> nearest(cross_check_ ? new nearest_queries(store_->first(), store_->size()) : nullptr);
+
+    if (index_ && !index_outdated_)
+    {
+        const auto search = [&](const uint8_t* query, const query_mask& mask, std::vector<cv::DMatch>& result) {
+            index_->radius_search(query, limit, mask, result);
+        };
+        match_indexed(queryDescriptors.getMat(), *store_, mask_collection, threads_, search, nearest.get(), matches);
+    }
+    else
+    {
+        match_blocked(queryDescriptors.getMat(), *store_, mask_collection, batch_size_, threads_, radius_collector(limit), nearest.get(), matches);
+    }
+
+    if (nearest)
+        nearest->keep_mutual([&](const cv::DMatch& m) { return store_->handle(m.imgIdx, m.trainIdx); }, matches);
+    if (compactResult)
+        compact_result(matches);
 }
 } // namespace cvlib
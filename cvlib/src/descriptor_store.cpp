@@ -0,0 +1,208 @@
+/* Storage of train descriptors implementation.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include "hamming_index.hpp"
+
+#include <thread>
+
+namespace cvlib
+{
+descriptor_store::descriptor_store(int block_rows) : block_rows_(block_rows)
+{
+    CV_Assert(block_rows > 0);
+}
+
+descriptor_store::~descriptor_store()
+{
+    stop_ = true;
+    if (compaction_.valid())
+        compaction_.wait();
+}
+
+cv::Ptr<descriptor_store> descriptor_store::clone() const
+{
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto copy = cv::makePtr<descriptor_store>(block_rows_);
+    copy->bytes_ = bytes_;
+    copy->stride_ = stride_;
+    copy->first_ = first_;
+    copy->image_of_ = image_of_;
+    copy->image_first_ = image_first_;
+    copy->stored_ = stored_;
+    copy->removed_ = removed_;
+    copy->blocks_ = blocks_;
+    copy->rows_.assign(rows_.size(), nullptr);
+    for (auto& b : copy->blocks_)
+    {
+        b.data = b.data.clone();
+        for (auto j = 0; j < static_cast<int>(b.handles.size()); ++j)
+            if (alive(b.handles[j]))
+                copy->rows_[b.handles[j] - first_] = b.data.ptr<uint8_t>(j);
+    }
+    return copy;
+}
+
+void descriptor_store::push(block& b, int handle, const uint8_t* desc)
+{
+    const auto slot = static_cast<int>(b.handles.size());
+    const auto train = train_idx(handle);
+    if (slot == 0)
+    {
+        b.img = image(handle);
+        b.first_train = train;
+    }
+    else if (b.img != image(handle))
+    {
+        b.img = -1;
+    }
+    b.last_train = train;
+
+    auto dst = b.data.ptr<uint8_t>(slot);
+    std::memcpy(dst, desc, bytes_);
+    b.handles.push_back(handle);
+    ++b.alive;
+    rows_[handle - first_] = dst;
+}
+
+int descriptor_store::append(const cv::Mat& descriptors)
+{
+    CV_Assert(descriptors.empty() || descriptors.type() == CV_8UC1);
+    CV_Assert(descriptors.empty() || bytes_ == 0 || bytes_ == descriptors.cols);
+    if (!descriptors.empty() && bytes_ == 0)
+    {
+        bytes_ = descriptors.cols;
+        stride_ = (bytes_ + 7) / 8 * 8;
+    }
+
+    const auto first = size();
+    const auto img = images();
+    image_first_.push_back(first);
+    rows_.resize(first - first_ + descriptors.rows, nullptr);
+    image_of_.resize(first - first_ + descriptors.rows, img);
+    for (auto i = 0; i < descriptors.rows; ++i)
+    {
+        if (blocks_.empty() || blocks_.back().handles.size() == static_cast<size_t>(block_rows_))
+        {
+            blocks_.emplace_back();
+            blocks_.back().data.create(block_rows_, stride_, CV_8UC1);
+        }
+        push(blocks_.back(), first + i, descriptors.ptr<uint8_t>(i));
+    }
+    stored_ += descriptors.rows;
+    return first;
+}
+
+bool descriptor_store::erase(int handle)
+{
+    CV_Assert(handle >= 0 && handle < size());
+    if (!alive(handle))
+        return false;
+    rows_[handle - first_] = nullptr;
+    ++removed_;
+
+    // blocks keep handles in increasing order
+    auto b = std::upper_bound(blocks_.begin(), blocks_.end(), handle, [](int h, const block& b) { return h < b.handles.front(); });
+    --(b - 1)->alive;
+
+    // compaction runs while removed rows take at least a quarter of the store
+    const auto running = compaction_.valid() && compaction_.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    if (!running && removed_ >= block_rows_ && removed_ * 4 >= stored_)
+    {
+        compaction_ = std::async(std::launch::async, [this] {
+            // the lock is released after every step, so matching is never blocked for long
+            while (!stop_)
+            {
+                std::unique_lock<std::shared_mutex> lock(mutex_);
+                if (removed_ * 8 < stored_ || !compact_step())
+                {
+                    trim();
+                    return;
+                }
+                lock.unlock();
+                std::this_thread::yield();
+            }
+        });
+    }
+    return true;
+}
+
+void descriptor_store::compact()
+{
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    while (compact_step())
+    {
+    }
+    trim();
+}
+
+void descriptor_store::clear()
+{
+    bytes_ = 0;
+    stride_ = 0;
+    blocks_.clear();
+    first_ = 0;
+    rows_.clear();
+    image_of_.clear();
+    image_first_.clear();
+    stored_ = 0;
+    removed_ = 0;
+}
+
+bool descriptor_store::compact_step()
+{
+    auto first = blocks_.begin();
+    while (first != blocks_.end() && first->alive == static_cast<int>(first->handles.size()))
+        ++first;
+    if (first == blocks_.end())
+        return false;
+
+    // the following blocks are merged while their rows fit into one block, so the order of handles is kept
+    auto last = first;
+    auto rows = 0;
+    while (last != blocks_.end() && rows + last->alive <= block_rows_)
+        rows += (last++)->alive;
+
+    block merged;
+    merged.data.create(block_rows_, stride_, CV_8UC1);
+    for (auto b = first; b != last; ++b)
+    {
+        stored_ -= static_cast<int>(b->handles.size());
+        removed_ -= static_cast<int>(b->handles.size()) - b->alive;
+        for (auto h : b->handles)
+            if (alive(h))
+                push(merged, h, row(h));
+    }
+    stored_ += rows;
+
+    const auto pos = blocks_.erase(first, last);
+    if (rows > 0)
+        blocks_.insert(pos, std::move(merged));
+    return true;
+}
+
+void descriptor_store::trim()
+{
+    // handles are never reused, so tables of handles before the oldest alive row are not needed anymore
+    const auto dead = std::find_if(rows_.begin(), rows_.end(), [](const uint8_t* r) { return r != nullptr; }) - rows_.begin();
+    if (dead == 0)
+        return;
+    first_ += static_cast<int>(dead);
+    rows_.erase(rows_.begin(), rows_.begin() + dead);
+    image_of_.erase(image_of_.begin(), image_of_.begin() + dead);
+    if (rows_.capacity() > 2 * rows_.size())
+    {
+        rows_.shrink_to_fit();
+        image_of_.shrink_to_fit();
+    }
+}
+
+int descriptor_store::handle(int img, int train_idx) const
+{
+    CV_Assert(img >= 0 && img < images());
+    CV_Assert(train_idx >= 0 && train_idx < image_rows(img));
+    return image_first_[img] + train_idx;
+}
+} // namespace cvlib
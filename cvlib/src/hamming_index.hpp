@@ -0,0 +1,480 @@
+/* Search structures for binary descriptors.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#ifndef __HAMMING_INDEX_HPP__
+#define __HAMMING_INDEX_HPP__
+
+#include "cvlib.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace cvlib
+{
+/// \brief Number of set bits in 64-bit word (portable SWAR version)
+inline int popcount(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+}
+
+/// \brief Hamming distance between two binary descriptors computed word by word
+/// \param limit, in - the computation stops as soon as partial distance exceeds this value
+/// \return exact distance if it is not greater than limit, any value greater than limit otherwise
+inline int hamming_distance(const uint8_t* a, const uint8_t* b, int bytes, int limit)
+{
+    auto dist = 0;
+    auto i = 0;
+    for (; i + 8 <= bytes; i += 8)
+    {
+        uint64_t wa, wb;
+        std::memcpy(&wa, a + i, sizeof(wa));
+        std::memcpy(&wb, b + i, sizeof(wb));
+        dist += popcount(wa ^ wb);
+        if (dist > limit)
+            return dist;
+    }
+    for (; i < bytes; ++i)
+        dist += popcount(a[i] ^ b[i]);
+    return dist;
+}
+
+/// \brief Mask rows of a single query for every train image, nullptr allows all rows of the image, empty vector allows everything
+typedef std::vector<const uint8_t*> query_mask;
+
+/// \brief Growable storage of train descriptors, removed rows are marked by tombstones and dropped by background compaction
+/// \details Every row gets permanent handle, handles of one train image are consecutive and follow the previous image.
+///          Rows are moved by compaction, so they are accessed by handles only.
+///          Callers hold mutex() shared while reading and exclusively while changing the store.
+class descriptor_store
+{
+    public:
+    /// \brief Rows stored together, every row starts at 64-bit word boundary
+    struct block
+    {
+        cv::Mat data; //< capacity x stride bytes
+        std::vector<int> handles; //< handle of every stored row in increasing order
+        int alive = 0; //< number of not removed rows
+        int img = -1; //< train image of all rows or -1 if the block keeps rows of several images
+        int first_train = 0; //< range of train indices if the block keeps rows of single image
+        int last_train = 0;
+    };
+
+    /// \brief ctor
+    /// \param block_rows, in - capacity of every block
+    explicit descriptor_store(int block_rows = 512);
+
+    /// \brief stops background compaction
+    ~descriptor_store();
+
+    descriptor_store(const descriptor_store&) = delete;
+    descriptor_store& operator=(const descriptor_store&) = delete;
+
+    /// \brief deep copy with the same handles
+    cv::Ptr<descriptor_store> clone() const;
+
+    /// \brief appends rows of new train image
+    /// \return handle of the first row
+    int append(const cv::Mat& descriptors);
+
+    /// \brief marks row as removed and starts background compaction when removed rows take too much space
+    /// \return false if the row has been removed already
+    bool erase(int handle);
+
+    /// \brief drops all removed rows now
+    void compact();
+
+    /// \brief drops all rows and images, the caller holds exclusive lock
+    void clear();
+
+    /// \brief handle of row of train image
+    int handle(int img, int train_idx) const;
+
+    bool alive(int handle) const
+    {
+        return handle >= first_ && rows_[handle - first_] != nullptr;
+    }
+
+    /// \brief descriptor of not removed row
+    const uint8_t* row(int handle) const
+    {
+        return rows_[handle - first_];
+    }
+
+    int image(int handle) const
+    {
+        return image_of_[handle - first_];
+    }
+
+    int train_idx(int handle) const
+    {
+        return handle - image_first_[image(handle)];
+    }
+
+    /// \brief the oldest handle which may be alive, all handles before it are removed
+    int first() const
+    {
+        return first_;
+    }
+
+    /// \brief number of issued handles including removed ones
+    int size() const
+    {
+        return first_ + static_cast<int>(rows_.size());
+    }
+
+    /// \brief number of not removed rows
+    int alive_count() const
+    {
+        return stored_ - removed_;
+    }
+
+    int images() const
+    {
+        return static_cast<int>(image_first_.size());
+    }
+
+    /// \brief number of rows of train image including removed ones
+    int image_rows(int img) const
+    {
+        return (img + 1 < images() ? image_first_[img + 1] : size()) - image_first_[img];
+    }
+
+    /// \brief descriptor length, zero until the first row is added
+    int bytes() const
+    {
+        return bytes_;
+    }
+
+    const std::vector<block>& blocks() const
+    {
+        return blocks_;
+    }
+
+    std::shared_mutex& mutex() const
+    {
+        return mutex_;
+    }
+
+    /// \brief checks whether the row is allowed by query mask
+    bool allowed(const query_mask& mask, int handle) const
+    {
+        if (mask.empty())
+            return true;
+        const auto m = mask[image(handle)];
+        return !m || m[train_idx(handle)];
+    }
+
+    /// \brief converts handle into match with train image and row
+    cv::DMatch to_match(int handle, int dist) const
+    {
+        return cv::DMatch(-1, train_idx(handle), image(handle), static_cast<float>(dist));
+    }
+
+    /// \brief converts sorted (distance, handle) pairs into matches
+    void to_matches(const std::vector<std::pair<int, int>>& found, std::vector<cv::DMatch>& result) const
+    {
+        result.clear();
+        for (const auto& f : found)
+            result.push_back(to_match(f.second, f.first));
+    }
+
+    private:
+    /// \brief appends row to the last block or to the new one
+    void push(block& b, int handle, const uint8_t* desc);
+
+    /// \brief merges the first run of blocks with removed rows, the caller holds exclusive lock
+    /// \return false if there are no removed rows
+    bool compact_step();
+
+    /// \brief drops tables of the oldest removed handles, the caller holds exclusive lock
+    void trim();
+
+    int block_rows_;
+    int bytes_ = 0;
+    int stride_ = 0;
+    std::vector<block> blocks_;
+    int first_ = 0; //< handle of the first item of rows and image_of
+    std::vector<const uint8_t*> rows_; //< descriptor of every handle since the first one, nullptr for removed rows
+    std::vector<int> image_of_; //< train image of every handle since the first one
+    std::vector<int> image_first_; //< handle of the first row of every train image
+    int stored_ = 0; //< number of rows kept in blocks including removed ones
+    int removed_ = 0; //< number of removed rows kept in blocks
+    mutable std::shared_mutex mutex_;
+    std::future<void> compaction_;
+    std::atomic<bool> stop_{false};
+};
+
+/// \brief Calls f for every mask of given length with exactly "weight" bits set in increasing order (Gosper's hack)
+template <typename F>
+void for_each_mask(int bits, int weight, F&& f)
+{
+    if (weight > bits)
+        return;
+
+    const auto end = 1ULL << bits;
+    for (auto mask = (1ULL << weight) - 1; mask < end;)
+    {
+        f(static_cast<uint32_t>(mask));
+
+        if (mask == 0)
+            break;
+        const auto lowest = mask & (~mask + 1);
+        const auto ripple = mask + lowest;
+        mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+    }
+}
+
+/// \brief Removes row from bucket of hash table, empty buckets are dropped
+inline void erase_from_bucket(std::unordered_map<uint32_t, std::vector<int>>& table, uint32_t key, int handle)
+{
+    const auto bucket = table.find(key);
+    if (bucket == table.end())
+        return;
+    auto& ids = bucket->second;
+    const auto pos = std::find(ids.begin(), ids.end(), handle);
+    if (pos != ids.end())
+    {
+        *pos = ids.back();
+        ids.pop_back();
+    }
+    if (ids.empty())
+        table.erase(bucket);
+}
+
+/// \brief Per-thread search buffers reused by all queries
+struct search_scratch
+{
+    std::vector<uint32_t> stamps; //< rows already checked for the current query are marked by its stamp
+    uint32_t current = 0;
+    int offset = 0; //< handle of the first stamp
+    std::vector<uint32_t> keys;
+    std::vector<std::pair<int, int>> found; //< (distance, handle)
+
+    /// \brief buffers of the calling thread
+    static search_scratch& local()
+    {
+        thread_local search_scratch s;
+        return s;
+    }
+
+    /// \brief prepares buffers for all handles of the store, buffers left by bigger stores are released
+    void next_query(const descriptor_store& store)
+    {
+        const auto rows = static_cast<size_t>(store.size() - store.first());
+        offset = store.first();
+        if (stamps.size() < rows || stamps.size() > 2 * rows + 1024)
+        {
+            stamps.assign(rows, 0);
+            current = 0;
+        }
+        if (++current == 0)
+        {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            current = 1;
+        }
+        found.clear();
+    }
+
+    /// \return false if row was visited by the current query already
+    bool visit(int id)
+    {
+        auto& stamp = stamps[id - offset];
+        if (stamp == current)
+            return false;
+        stamp = current;
+        return true;
+    }
+
+    /// \brief keeps k nearest rows in found sorted by (distance, index)
+    void keep_nearest(int k, int dist, int id)
+    {
+        const std::pair<int, int> candidate(dist, id);
+        if (found.size() == static_cast<size_t>(k))
+        {
+            if (!(candidate < found.back()))
+                return;
+            found.pop_back();
+        }
+        found.insert(std::upper_bound(found.begin(), found.end(), candidate), candidate);
+    }
+
+    /// \brief distance limit for candidates of k nearest search
+    int nearest_limit(int k) const
+    {
+        return found.size() == static_cast<size_t>(k) ? found.back().first : std::numeric_limits<int>::max();
+    }
+};
+
+/// \brief Base class of search structures over train descriptors of descriptor_matcher
+class hamming_index
+{
+    public:
+    virtual ~hamming_index() = default;
+
+    /// \brief Creates empty index of the same kind and with the same parameters
+    virtual cv::Ptr<hamming_index> create_empty() const = 0;
+
+    /// \brief Copies index which refers to the copy of its descriptor store
+    virtual cv::Ptr<hamming_index> clone(const descriptor_store& store) const = 0;
+
+    /// \brief Builds index over all not removed rows of the store, the index keeps reference to it
+    virtual void build(const descriptor_store& store) = 0;
+
+    /// \brief Adds row appended to the store after build
+    virtual void insert(int handle) = 0;
+
+    /// \brief Drops row before it is removed from the store
+    virtual void erase(int handle) = 0;
+
+    /// \brief Finds k nearest train descriptors allowed by mask sorted by distance (queryIdx is left unset)
+    virtual void knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const = 0;
+
+    /// \brief Finds all train descriptors allowed by mask with distance not greater than max_dist sorted by distance (queryIdx is left unset)
+    virtual void radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const = 0;
+};
+
+/// \brief Multi-index hashing: exact search by probing hash tables built over descriptor substrings
+/// \see M. Norouzi, A. Punjani, D. Fleet "Fast Exact Search in Hamming Space with Multi-Index Hashing"
+class mih_index : public hamming_index
+{
+    public:
+    /// \brief ctor
+    /// \param substrings, in - number of hash tables, non-positive value means to choose it by the train set size
+    explicit mih_index(int substrings = 0) : substrings_(substrings)
+    {
+    }
+
+    cv::Ptr<hamming_index> create_empty() const override;
+    cv::Ptr<hamming_index> clone(const descriptor_store& store) const override;
+    void build(const descriptor_store& store) override;
+    void insert(int handle) override;
+    void erase(int handle) override;
+    void knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+    void radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+
+    private:
+    /// \brief extracts bits of t-th substring
+    uint32_t substring(const uint8_t* desc, int t) const;
+
+    /// \brief calls visit for rows in all buckets of t-th table on exactly given distance from key
+    template <typename Visitor>
+    void probe(int t, uint32_t key, int radius, Visitor&& visit) const;
+
+    int substrings_;
+    const descriptor_store* store_ = nullptr;
+    std::vector<int> bit_begin_; //< first bit of every substring, the last item is total bits count
+    int max_bits_ = 0; //< length of the longest substring
+    std::vector<std::unordered_map<uint32_t, std::vector<int>>> tables_;
+};
+
+/// \brief Approximate search with locality sensitive hashing of sampled bits and multi-probe of neighbour buckets
+/// \see Q. Lv, W. Josephson, Z. Wang et al. "Multi-Probe LSH: Efficient Indexing for High-Dimensional Similarity Search"
+class lsh_index : public hamming_index
+{
+    public:
+    /// \brief ctor
+    /// \param tables, in - number of hash tables
+    /// \param key_size, in - number of sampled bits in hash key (not greater than 32)
+    /// \param probe_level, in - max Hamming distance between query key and probed bucket keys
+    lsh_index(int tables, int key_size, int probe_level) : tables_count_(tables), key_size_(key_size), probe_level_(probe_level)
+    {
+        CV_Assert(tables > 0 && key_size > 0 && key_size <= 32 && probe_level >= 0);
+    }
+
+    cv::Ptr<hamming_index> create_empty() const override;
+    cv::Ptr<hamming_index> clone(const descriptor_store& store) const override;
+    void build(const descriptor_store& store) override;
+    void insert(int handle) override;
+    void erase(int handle) override;
+    void knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+    void radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+
+    private:
+    /// \brief gathers sampled bits of t-th table
+    uint32_t key(const uint8_t* desc, int t) const;
+
+    /// \brief calls visit for rows in all probed buckets of all tables
+    template <typename Visitor>
+    void probe(const uint8_t* query, Visitor&& visit) const;
+
+    int tables_count_;
+    int key_size_;
+    int probe_level_;
+    const descriptor_store* store_ = nullptr;
+    std::vector<std::vector<int>> bits_; //< sampled bit positions of every table
+    std::vector<std::unordered_map<uint32_t, std::vector<int>>> tables_;
+};
+
+/// \brief Approximate search in randomized hierarchical clustering trees with medoids as cluster centers
+/// \see M. Muja, D. Lowe "Fast Matching of Binary Features"
+class clustering_index : public hamming_index
+{
+    public:
+    /// \brief ctor
+    /// \param trees, in - number of independently built trees
+    /// \param branching, in - number of clusters in every split
+    /// \param leaf_size, in - max number of descriptors in leaf
+    /// \param max_checks, in - max number of descriptors compared with a query
+    clustering_index(int trees, int branching, int leaf_size, int max_checks)
+        : trees_count_(trees), branching_(branching), leaf_size_(leaf_size), max_checks_(max_checks)
+    {
+        CV_Assert(trees > 0 && branching > 1 && leaf_size > 0 && max_checks > 0);
+    }
+
+    cv::Ptr<hamming_index> create_empty() const override;
+    cv::Ptr<hamming_index> clone(const descriptor_store& store) const override;
+    void build(const descriptor_store& store) override;
+    void insert(int handle) override;
+    void erase(int handle) override;
+    void knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+    void radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const override;
+
+    private:
+    struct node
+    {
+        int pivot; //< row of the cluster medoid in pivots of the tree, -1 for the root
+        int first_child; //< children are stored one after another, -1 for leaves
+        int child_count;
+        std::vector<int> points; //< handles of leaf descriptors
+    };
+
+    struct tree
+    {
+        std::vector<node> nodes; //< the root is the first one
+        std::vector<uint8_t> pivots; //< medoids are copied since their rows may be removed from the store
+        cv::RNG rng; //< splits leaves overflowed by inserted rows
+    };
+
+    /// \brief splits points of the tree leaf into clusters
+    void split(tree& t, int n) const;
+
+    /// \brief leaf which contains (or would contain) the descriptor
+    int find_leaf(const tree& t, const uint8_t* desc) const;
+
+    /// \brief best-first traversal of all trees until the checks budget is spent
+    template <typename Visitor>
+    void traverse(const uint8_t* query, Visitor&& visit) const;
+
+    int trees_count_;
+    int branching_;
+    int leaf_size_;
+    int max_checks_;
+    const descriptor_store* store_ = nullptr;
+    std::vector<tree> trees_;
+};
+} // namespace cvlib
+
+#endif // __HAMMING_INDEX_HPP__
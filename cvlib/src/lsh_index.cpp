@@ -0,0 +1,132 @@
+/* Multi-probe LSH for binary descriptors implementation.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include "hamming_index.hpp"
+
+namespace cvlib
+{
+cv::Ptr<hamming_index> lsh_index::create_empty() const
+{
+    return cv::makePtr<lsh_index>(tables_count_, key_size_, probe_level_);
+}
+
+cv::Ptr<hamming_index> lsh_index::clone(const descriptor_store& store) const
+{
+    auto copy = cv::makePtr<lsh_index>(*this);
+    copy->store_ = &store;
+    return copy;
+}
+
+void lsh_index::build(const descriptor_store& store)
+{
+    store_ = &store;
+
+    // the same seed gives the same hash functions, so results are reproducible
+    cv::RNG rng(0x5eed);
+    const auto bits = store.bytes() * 8;
+    std::vector<int> positions(bits);
+    for (auto i = 0; i < bits; ++i)
+        positions[i] = i;
+
+    const auto key_size = std::min(key_size_, bits);
+    bits_.assign(tables_count_, {});
+    for (auto& table_bits : bits_)
+    {
+        for (auto i = 0; i < key_size; ++i)
+            std::swap(positions[i], positions[rng.uniform(i, bits)]);
+        table_bits.assign(positions.begin(), positions.begin() + key_size);
+    }
+
+    tables_.assign(tables_count_, {});
+    for (auto t = 0; t < tables_count_; ++t)
+    {
+        tables_[t].reserve(store.alive_count());
+        for (auto id = store.first(); id < store.size(); ++id)
+            if (store.alive(id))
+                tables_[t][key(store.row(id), t)].push_back(id);
+    }
+}
+
+void lsh_index::insert(int handle)
+{
+    for (auto t = 0; t < tables_count_; ++t)
+        tables_[t][key(store_->row(handle), t)].push_back(handle);
+}
+
+void lsh_index::erase(int handle)
+{
+    for (auto t = 0; t < tables_count_; ++t)
+        erase_from_bucket(tables_[t], key(store_->row(handle), t), handle);
+}
+
+uint32_t lsh_index::key(const uint8_t* desc, int t) const
+{
+    uint32_t res = 0;
+    for (auto bit : bits_[t])
+        res = (res << 1) | ((desc[bit / 8] >> (bit % 8)) & 1);
+    return res;
+}
+
+template <typename Visitor>
+void lsh_index::probe(const uint8_t* query, Visitor&& visit) const
+{
+    for (auto t = 0; t < tables_count_; ++t)
+    {
+        const auto& table = tables_[t];
+        const auto k = key(query, t);
+        const auto key_bits = static_cast<int>(bits_[t].size());
+        for (auto level = 0; level <= probe_level_; ++level)
+        {
+            for_each_mask(key_bits, level, [&](uint32_t mask) {
+                const auto bucket = table.find(k ^ mask);
+                if (bucket != table.end())
+                    for (auto id : bucket->second)
+                        visit(id);
+            });
+        }
+    }
+}
+
+void lsh_index::knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || k <= 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    probe(query, [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return;
+        const auto limit = s.nearest_limit(k);
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), limit);
+        if (dist <= limit)
+            s.keep_nearest(k, dist, id);
+    });
+
+    store_->to_matches(s.found, result);
+}
+
+void lsh_index::radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || max_dist < 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    probe(query, [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return;
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), max_dist);
+        if (dist <= max_dist)
+            s.found.emplace_back(dist, id);
+    });
+
+    std::sort(s.found.begin(), s.found.end());
+    store_->to_matches(s.found, result);
+}
+} // namespace cvlib
@@ -0,0 +1,183 @@
+/* Multi-index hashing for binary descriptors implementation.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include "hamming_index.hpp"
+
+#include <cmath>
+
+namespace
+{
+double binomial(int n, int k)
+{
+    auto res = 1.0;
+    for (auto i = 1; i <= k; ++i)
+        res = res * (n - k + i) / i;
+    return res;
+}
+} // namespace
+
+namespace cvlib
+{
+cv::Ptr<hamming_index> mih_index::create_empty() const
+{
+    return cv::makePtr<mih_index>(substrings_);
+}
+
+cv::Ptr<hamming_index> mih_index::clone(const descriptor_store& store) const
+{
+    auto copy = cv::makePtr<mih_index>(*this);
+    copy->store_ = &store;
+    return copy;
+}
+
+void mih_index::build(const descriptor_store& store)
+{
+    store_ = &store;
+
+    // substrings of about log2(N) bits make the expected bucket size close to one
+    const auto bits = store.bytes() * 8;
+    auto m = substrings_;
+    if (m <= 0)
+        m = static_cast<int>(std::round(bits / std::max(1.0, std::log2(store.alive_count()))));
+    m = std::max(std::min(m, bits), (bits + 31) / 32);
+
+    bit_begin_.resize(m + 1);
+    max_bits_ = 0;
+    for (auto t = 0; t <= m; ++t)
+    {
+        bit_begin_[t] = t * bits / m;
+        if (t > 0)
+            max_bits_ = std::max(max_bits_, bit_begin_[t] - bit_begin_[t - 1]);
+    }
+
+    tables_.assign(m, {});
+    for (auto t = 0; t < m; ++t)
+    {
+        tables_[t].reserve(store.alive_count());
+        for (auto id = store.first(); id < store.size(); ++id)
+            if (store.alive(id))
+                tables_[t][substring(store.row(id), t)].push_back(id);
+    }
+}
+
+void mih_index::insert(int handle)
+{
+    // substrings were chosen for the initial size, the search stays exact anyway
+    for (auto t = 0; t < static_cast<int>(tables_.size()); ++t)
+        tables_[t][substring(store_->row(handle), t)].push_back(handle);
+}
+
+void mih_index::erase(int handle)
+{
+    for (auto t = 0; t < static_cast<int>(tables_.size()); ++t)
+        erase_from_bucket(tables_[t], substring(store_->row(handle), t), handle);
+}
+
+uint32_t mih_index::substring(const uint8_t* desc, int t) const
+{
+    const auto begin = bit_begin_[t];
+    const auto len = bit_begin_[t + 1] - begin;
+
+    uint64_t word = 0;
+    const auto first = begin / 8;
+    const auto last = (begin + len + 7) / 8;
+    for (auto b = first; b < last; ++b)
+        word |= static_cast<uint64_t>(desc[b]) << (8 * (b - first));
+
+    return static_cast<uint32_t>((word >> (begin % 8)) & ((1ULL << len) - 1));
+}
+
+template <typename Visitor>
+void mih_index::probe(int t, uint32_t key, int radius, Visitor&& visit) const
+{
+    const auto& table = tables_[t];
+    const auto bits = bit_begin_[t + 1] - bit_begin_[t];
+    if (radius > bits)
+        return;
+
+    // far probes enumerate more keys than the table has buckets, so just scan it
+    if (binomial(bits, radius) > table.size())
+    {
+        for (const auto& bucket : table)
+            if (popcount(bucket.first ^ key) == radius)
+                for (auto id : bucket.second)
+                    visit(id);
+        return;
+    }
+
+    for_each_mask(bits, radius, [&](uint32_t mask) {
+        const auto bucket = table.find(key ^ mask);
+        if (bucket != table.end())
+            for (auto id : bucket->second)
+                visit(id);
+    });
+}
+
+void mih_index::knn_search(const uint8_t* query, int k, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || k <= 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    const auto m = static_cast<int>(tables_.size());
+    s.keys.resize(m);
+    for (auto t = 0; t < m; ++t)
+        s.keys[t] = substring(query, t);
+
+    const auto visit = [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return;
+        const auto limit = s.nearest_limit(k);
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), limit);
+        if (dist <= limit)
+            s.keep_nearest(k, dist, id);
+    };
+
+    // after all tables are probed up to radius r every row closer than m * (r + 1) has been checked
+    for (auto r = 0; r <= max_bits_; ++r)
+    {
+        for (auto t = 0; t < m; ++t)
+            probe(t, s.keys[t], r, visit);
+        if (s.found.size() == static_cast<size_t>(k) && s.found.back().first < m * (r + 1))
+            break;
+    }
+
+    store_->to_matches(s.found, result);
+}
+
+void mih_index::radius_search(const uint8_t* query, int max_dist, const query_mask& mask, std::vector<cv::DMatch>& result) const
+{
+    result.clear();
+    if (store_->alive_count() == 0 || max_dist < 0)
+        return;
+
+    auto& s = search_scratch::local();
+    s.next_query(*store_);
+    const auto m = static_cast<int>(tables_.size());
+
+    const auto visit = [&](int id) {
+        if (!store_->alive(id) || !s.visit(id) || !store_->allowed(mask, id))
+            return;
+        const auto dist = hamming_distance(query, store_->row(id), store_->bytes(), max_dist);
+        if (dist <= max_dist)
+            s.found.emplace_back(dist, id);
+    };
+
+    // by pigeonhole principle one of substrings is not farther than max_dist / m
+    const auto radius = std::min(max_dist / m, max_bits_);
+    for (auto t = 0; t < m; ++t)
+    {
+        const auto key = substring(query, t);
+        for (auto r = 0; r <= radius; ++r)
+            probe(t, key, r, visit);
+    }
+
+    std::sort(s.found.begin(), s.found.end());
+    store_->to_matches(s.found, result);
+}
+} // namespace cvlib
@@ -5,72 +5,314 @@
  */
 
 #include "cvlib.hpp"
+#include <algorithm>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 
 namespace
 {
-struct descriptor : public std::vector<double>
+/// \brief Max number of filter banks of different kernel sizes kept in cache
+const size_t bank_cache_size = 8;
+
+/// \brief Max total size of kernels and spectra of cached banks, the last used bank is kept anyway
+const size_t bank_cache_bytes = size_t(64) << 20;
+
+/// \brief Kernels of this size and larger are applied in frequency domain
+const int dft_min_kernel_size = 17;
+
+/// \brief Max number of filter responses computed at once, so memory doesn't grow with number of threads
+const int filter_group_size = 8;
+
+/// \brief Buffers of the calling thread are released at the end of the call if they take more
+const size_t cached_buffers_bytes = size_t(64) << 20;
+
+/// \brief Memory taken by matrix elements
+size_t mat_bytes(const cv::Mat& m)
+{
+    return m.total() * m.elemSize();
+}
+
+/// \brief Gabor kernels for all combinations of parameters
+class gabor_bank
 {
-    using std::vector<double>::vector;
-    descriptor operator-(const descriptor& right) const
+    public:
+    /// \brief builds kernels of given size
+    /// \param rank, in - number of separable kernels approximating every kernel, non-positive value means exact kernels
+    gabor_bank(int kernel_size, int rank)
     {
-        descriptor temp = *this;
-        for (size_t i = 0; i < temp.size(); ++i)
+        // \todo implement complete texture segmentation based on Gabor filters
+        // (find good combinations for all Gabor's parameters)
+        for (auto th = 0; th < 4; ++th)
         {
-            temp[i] -= right[i];
+            for (auto lm = 10; lm <= 100; lm += 30)
+            {
+                for (auto gm = 1; gm <= 4; ++gm)
+                {
+                    for (auto sig = 5; sig <= 15; sig += 5)
+                        kernels_.push_back(cv::getGaborKernel(cv::Size(kernel_size, kernel_size), sig, th * CV_PI / 4, lm, gm * 0.25));
+                }
+            }
+        }
+
+        // rank-1 terms are singular vectors of kernel scaled by square root of singular value
+        if (rank > 0)
+        {
+            cv::Mat w, u, vt;
+            for (const auto& kernel : kernels_)
+            {
+                cv::SVD::compute(kernel, w, u, vt);
+                separable_.emplace_back();
+                for (auto i = 0; i < std::min(rank, kernel_size); ++i)
+                {
+                    const auto scale = std::sqrt(w.at<double>(i));
+                    cv::Mat column = u.col(i) * scale;
+                    cv::Mat row = vt.row(i) * scale;
+                    separable_.back().emplace_back(row, column);
+                }
+            }
+        }
+        // image is filtered by overlap-save blocks, so size of spectra depends on kernel size only
+        else if (kernel_size >= dft_min_kernel_size)
+        {
+            dft_size_ = cv::getOptimalDFTSize(2 * kernel_size);
+            cv::Mat padded = cv::Mat::zeros(dft_size_, dft_size_, CV_32F);
+            for (const auto& kernel : kernels_)
+            {
+                kernel.convertTo(padded(cv::Rect(0, 0, kernel_size, kernel_size)), CV_32F);
+                spectra_.emplace_back();
+                cv::dft(padded, spectra_.back());
+            }
         }
-        return temp;
     }
 
-    double norm_l1() const
+    /// \brief gives bank of given kernel size and rank, kernels are built once and shared by all calls
+    static cv::Ptr<const gabor_bank> get(int kernel_size, int rank)
     {
-        double res = 0.0;
-        for (auto v : *this)
+        struct cache_entry
         {
-            res += std::abs(v);
+            cv::Ptr<const gabor_bank> bank;
+            uint64_t last_use; //< value of use counter at the last call which took the bank
+        };
+        static std::mutex mutex;
+        static std::map<std::pair<int, int>, cache_entry> cache;
+        static uint64_t uses = 0;
+
+        rank = std::max(rank, 0);
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto older = [](const auto& a, const auto& b) { return a.second.last_use < b.second.last_use; };
+        auto entry = cache.find({kernel_size, rank});
+        if (entry == cache.end())
+        {
+            // size of ROI may be changed by user many times, so only a few recently used banks are kept
+            if (cache.size() >= bank_cache_size)
+                cache.erase(std::min_element(cache.begin(), cache.end(), older));
+            entry = cache.emplace(std::make_pair(kernel_size, rank), cache_entry{cv::makePtr<const gabor_bank>(kernel_size, rank), 0}).first;
         }
-        return res;
+        entry->second.last_use = ++uses;
+
+        // spectra of large kernels take megabytes, so banks are evicted by total size as well
+        const auto bytes = [](size_t sum, const auto& e) { return sum + e.second.bank->bytes(); };
+        while (cache.size() > 1 && std::accumulate(cache.begin(), cache.end(), size_t(0), bytes) > bank_cache_bytes)
+            cache.erase(std::min_element(cache.begin(), cache.end(), older));
+        return entry->second.bank;
+    }
+
+    const std::vector<cv::Mat>& kernels() const
+    {
+        return kernels_;
     }
 
-    double norm_l2() const
+    /// \brief size of square blocks filtered in frequency domain, 0 if kernels are applied in spatial domain
+    int dft_size() const
     {
-        double res = 0.0;
-        for (auto v : *this)
+        return dft_size_;
+    }
+
+    /// \brief spectra of kernels zero-padded to DFT size, packed in CCS format of cv::dft
+    const std::vector<cv::Mat>& spectra() const
+    {
+        return spectra_;
+    }
+
+    /// \brief memory taken by kernels and their spectra
+    size_t bytes() const
+    {
+        auto sum = size_t(0);
+        for (const auto& m : kernels_)
+            sum += mat_bytes(m);
+        for (const auto& m : spectra_)
+            sum += mat_bytes(m);
+        for (const auto& terms : separable_)
         {
-            res += v*v;
+            for (const auto& t : terms)
+                sum += mat_bytes(t.first) + mat_bytes(t.second);
         }
-        return res;
+        return sum;
     }
+
+    /// \brief row and column kernels approximating every kernel, empty if exact kernels are used
+    const std::vector<std::vector<std::pair<cv::Mat, cv::Mat>>>& separable() const
+    {
+        return separable_;
+    }
+
+    private:
+    std::vector<cv::Mat> kernels_;
+    int dft_size_ = 0;
+    std::vector<cv::Mat> spectra_;
+    std::vector<std::vector<std::pair<cv::Mat, cv::Mat>>> separable_;
 };
 
-void calculateDescriptor(const cv::Mat& image, int kernel_size, descriptor& descr)
+/// \brief Scratch buffers of one filter of the group applied concurrently, they are reused by the next groups and calls
+struct filter_buffers
 {
-    descr.clear();
     cv::Mat response;
-    cv::Mat mean;
-    cv::Mat dev;
-
-    // \todo implement complete texture segmentation based on Gabor filters
-    // (find good combinations for all Gabor's parameters)
-    for (auto th = 0.0; th <= 3 * CV_PI / 4; th += CV_PI / 4)
-	{
-		for (auto lm = 10; lm <= 100; lm += 30)
-		{
-			for (auto gm = 0.25; gm <= 1; gm += 0.25)
-			{
-                for (auto sig = 5; sig <= 15; sig += 5)
-                {
-                    cv::Mat kernel = cv::getGaborKernel(cv::Size(kernel_size, kernel_size), sig, th, lm, gm);
-                    cv::filter2D(image, response, CV_32F, kernel);
-                    cv::meanStdDev(response, mean, dev);
-                    descr.emplace_back(mean.at<double>(0));
-                    descr.emplace_back(dev.at<double>(0));
-                }
-            }
+    cv::Mat sum; //< integral of response
+    cv::Mat sqsum; //< integral of squared response
+    cv::Mat product; //< product of image block and kernel spectra
+    cv::Mat block_response;
+    cv::Mat term; //< response of one separable kernel
+
+    size_t bytes() const
+    {
+        return mat_bytes(response) + mat_bytes(sum) + mat_bytes(sqsum) + mat_bytes(product) + mat_bytes(block_response) + mat_bytes(term);
+    }
+};
+
+/// \brief Responses of bank filters for one image, buffers are reused for the next images
+class bank_filter
+{
+    public:
+    /// \brief setup image, its blocks are transformed once for all filters if the bank works in frequency domain
+    void set_image(const cv::Mat& image, const cv::Ptr<const gabor_bank>& bank);
+
+    /// \brief computes response of filter of the bank into buffers.response, may be called concurrently
+    void response(int filter, filter_buffers& buffers) const;
+
+    /// \brief memory taken by transformed image
+    size_t bytes() const;
+
+    /// \brief drops the image, so it is not kept after the call
+    /// \param buffers, in - release memory of transformed image too instead of keeping it for the next image
+    void release(bool buffers);
+
+    private:
+    cv::Ptr<const gabor_bank> bank_;
+    cv::Mat image_;
+    cv::Mat padded_; //< image with reflected borders
+    cv::Mat block_; //< zero-padded block of image
+    std::vector<cv::Mat> blocks_; //< CCS-packed spectra of image blocks
+};
+
+void bank_filter::set_image(const cv::Mat& image, const cv::Ptr<const gabor_bank>& bank)
+{
+    bank_ = bank;
+    image_ = image;
+    const auto n = bank->dft_size();
+    if (n == 0)
+        return;
+
+    // every block gives (n - kernel_size + 1)^2 pixels of response without circular overlap
+    const auto k = bank->kernels().front().rows;
+    const auto step = n - k + 1;
+    cv::copyMakeBorder(image, padded_, k / 2, k / 2, k / 2, k / 2, cv::BORDER_REFLECT_101);
+    block_.create(n, n, CV_32F);
+    blocks_.resize(((image.rows + step - 1) / step) * ((image.cols + step - 1) / step));
+    auto b = blocks_.begin();
+    for (auto y = 0; y < image.rows; y += step)
+    {
+        for (auto x = 0; x < image.cols; x += step)
+        {
+            const auto area = cv::Rect(x, y, n, n) & cv::Rect(0, 0, padded_.cols, padded_.rows);
+            block_.setTo(0);
+            padded_(area).convertTo(block_(cv::Rect(0, 0, area.width, area.height)), CV_32F);
+            cv::dft(block_, *b++);
+        }
+    }
+}
+
+size_t bank_filter::bytes() const
+{
+    auto sum = mat_bytes(padded_) + mat_bytes(block_);
+    for (const auto& b : blocks_)
+        sum += mat_bytes(b);
+    return sum;
+}
+
+void bank_filter::release(bool buffers)
+{
+    bank_.reset();
+    image_.release();
+    if (!buffers)
+        return;
+    padded_.release();
+    block_.release();
+    std::vector<cv::Mat>().swap(blocks_);
+}
+
+void bank_filter::response(int filter, filter_buffers& buffers) const
+{
+    auto& res = buffers.response;
+    if (!bank_->separable().empty())
+    {
+        // each term costs two 1-D passes instead of one 2-D pass
+        const auto& terms = bank_->separable()[filter];
+        cv::sepFilter2D(image_, res, CV_32F, terms.front().first, terms.front().second);
+        for (auto t = terms.begin() + 1; t != terms.end(); ++t)
+        {
+            cv::sepFilter2D(image_, buffers.term, CV_32F, t->first, t->second);
+            res += buffers.term;
         }
+        return;
+    }
+
+    const auto n = bank_->dft_size();
+    if (n == 0)
+    {
+        cv::filter2D(image_, res, CV_32F, bank_->kernels()[filter]);
+        return;
+    }
+
+    // filter2D computes correlation, so spectrum of kernel is conjugated
+    const auto step = n - bank_->kernels().front().rows + 1;
+    res.create(image_.size(), CV_32F);
+    auto b = blocks_.begin();
+    for (auto y = 0; y < image_.rows; y += step)
+    {
+        for (auto x = 0; x < image_.cols; x += step)
+        {
+            cv::mulSpectrums(*b++, bank_->spectra()[filter], buffers.product, 0, true);
+            cv::idft(buffers.product, buffers.block_response, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+            const cv::Rect area(x, y, std::min(step, image_.cols - x), std::min(step, image_.rows - y));
+            buffers.block_response(cv::Rect(0, 0, area.width, area.height)).copyTo(res(area));
+        }
+    }
+}
+
+/// \brief Bounds of windows of given size centered at every position, windows are clipped by image bounds
+void window_bounds(int length, int window, std::vector<int>& first, std::vector<int>& last)
+{
+    first.resize(length);
+    last.resize(length);
+    for (auto i = 0; i < length; ++i)
+    {
+        first[i] = std::max(i - window / 2, 0);
+        last[i] = std::min(i - window / 2 + window, length);
     }
 }
 
+/// \brief Mean and standard deviation of filter response in window from integral images of response and squared response
+void window_stats(const cv::Mat& sum, const cv::Mat& sqsum, int x0, int y0, int x1, int y1, double& mean, double& stddev)
+{
+    const auto area = static_cast<double>((x1 - x0) * (y1 - y0));
+    const auto s = sum.at<double>(y1, x1) - sum.at<double>(y0, x1) - sum.at<double>(y1, x0) + sum.at<double>(y0, x0);
+    const auto sq = sqsum.at<double>(y1, x1) - sqsum.at<double>(y0, x1) - sqsum.at<double>(y1, x0) + sqsum.at<double>(y0, x0);
+    mean = s / area;
+    stddev = std::sqrt(std::max(sq / area - mean * mean, 0.));
+}
+
 int nearest_odd_integer(double v)
 {
     if (v >= std::numeric_limits<int>::max()) 
@@ -96,37 +338,134 @@ int nearest_odd_integer(double v)
 
     return negative ? -ival : ival;
 }
+
+/// \brief Buffers of the calling thread are kept for the next call unless they take too much memory
+void release_buffers(bank_filter& filter, std::vector<filter_buffers>& buffers)
+{
+    auto bytes = filter.bytes();
+    for (const auto& b : buffers)
+        bytes += b.bytes();
+    const auto large = bytes > cached_buffers_bytes;
+    filter.release(large);
+    if (large)
+        std::vector<filter_buffers>().swap(buffers);
+}
+
+int kernel_size_of(const cv::Rect& roi)
+{
+    return nearest_odd_integer(std::min(roi.height, roi.width) / 2); // \todo round to nearest odd
+}
 } // namespace
 
 namespace cvlib
 {
-cv::Mat select_texture(const cv::Mat& image, const cv::Rect& roi, double eps)
+std::vector<double> texture_descriptor(const cv::Mat& image, const cv::Rect& roi, int rank)
 {
-    cv::Mat imROI = image(roi);
+    CV_Assert(image.channels() == 1);
+    CV_Assert(roi.area() > 0 && (roi & cv::Rect(0, 0, image.cols, image.rows)) == roi);
+
+    const auto bank = gabor_bank::get(kernel_size_of(roi), rank);
+    const auto filters = static_cast<int>(bank->kernels().size());
+
+    // workers share the filter of the calling thread, its image state is read only
+    thread_local bank_filter cached_filter;
+    thread_local std::vector<filter_buffers> cached_buffers;
+    const auto& filter = cached_filter;
+    auto& buffers = cached_buffers;
+    cached_filter.set_image(image, bank);
+    buffers.resize(std::min({cv::getNumThreads(), filter_group_size, filters}));
+    const auto group = static_cast<int>(buffers.size());
 
-    const int kernel_size = nearest_odd_integer(std::min(roi.height, roi.width) / 2); // \todo round to nearest odd
+    // filters are independent, each one writes its own pair of values
+    std::vector<double> descr(2 * filters);
+    for (auto first = 0; first < filters; first += group)
+    {
+        cv::parallel_for_(cv::Range(first, std::min(first + group, filters)), [&](const cv::Range& range) {
+            cv::Mat mean;
+            cv::Mat dev;
+            for (auto f = range.start; f < range.end; ++f)
+            {
+                auto& b = buffers[f - first];
+                filter.response(f, b);
+                cv::meanStdDev(b.response(roi), mean, dev);
+                descr[2 * f] = mean.at<double>(0);
+                descr[2 * f + 1] = dev.at<double>(0);
+            }
+        });
+    }
+
+    release_buffers(cached_filter, cached_buffers);
+    return descr;
+}
+
+cv::Mat select_texture(const cv::Mat& image, const cv::Rect& roi, double eps, int rank)
+{
+    CV_Assert(image.channels() == 1);
+    CV_Assert(roi.area() > 0 && (roi & cv::Rect(0, 0, image.cols, image.rows)) == roi);
 
-    descriptor reference;
-    calculateDescriptor(image(roi), kernel_size, reference);
+    const auto kernel_size = kernel_size_of(roi);
+    const auto bank = gabor_bank::get(kernel_size, rank);
+    const auto filters = static_cast<int>(bank->kernels().size());
 
-    cv::Mat res = cv::Mat::zeros(image.size(), CV_8UC1);
+    std::vector<int> x0, x1, y0, y1;
+    window_bounds(image.cols, roi.width, x0, x1);
+    window_bounds(image.rows, roi.height, y0, y1);
 
-    descriptor test(reference.size());
-    cv::Rect baseROI = roi - roi.tl();
+    thread_local bank_filter cached_filter;
+    thread_local std::vector<filter_buffers> cached_buffers;
+    const auto& filter = cached_filter;
+    auto& buffers = cached_buffers;
+    cached_filter.set_image(image, bank);
+    buffers.resize(std::min({cv::getNumThreads(), filter_group_size, filters}));
+    const auto group = static_cast<int>(buffers.size());
 
-    // \todo move ROI smoothly pixel-by-pixel
-    for (int i = 0; i < image.size().width / roi.width; i += 10)
+    // every filter response is computed once for the whole image, so descriptor of window of ROI size centered at every pixel
+    // is taken from integral images; filters of a group are applied concurrently, then squared distance to the reference
+    // descriptor is accumulated into one map by strips of rows, so only responses of the group are kept at once
+    cv::Mat dist(image.size(), CV_64F);
+    dist.setTo(0);
+    cv::Mat res(image.size(), CV_8UC1);
+    std::vector<std::pair<double, double>> reference(group); //< mean and standard deviation of response in ROI
+    for (auto first = 0; first < filters; first += group)
     {
-        for (int j = 0; j < image.size().height / roi.height; j += 10)
-        {
-            auto curROI = baseROI + cv::Point(i, j);
-            calculateDescriptor(image(curROI), kernel_size, test);
+        const auto last = std::min(first + group, filters);
+        cv::parallel_for_(cv::Range(first, last), [&](const cv::Range& range) {
+            for (auto f = range.start; f < range.end; ++f)
+            {
+                auto& b = buffers[f - first];
+                filter.response(f, b);
+                cv::integral(b.response, b.sum, b.sqsum, CV_64F, CV_64F);
+                auto& ref = reference[f - first];
+                window_stats(b.sum, b.sqsum, roi.x, roi.y, roi.x + roi.width, roi.y + roi.height, ref.first, ref.second);
+            }
+        });
 
-            // \todo implement and use norm L2
-            res(curROI) = 255 * ((test - reference).norm_l2() <= eps);
-        }
+        // the last group thresholds rows right after their distances are complete
+        cv::parallel_for_(cv::Range(0, image.rows), [&](const cv::Range& range) {
+            for (auto y = range.start; y < range.end; ++y)
+            {
+                auto d = dist.ptr<double>(y);
+                for (auto i = 0; i < last - first; ++i)
+                {
+                    const auto& b = buffers[i];
+                    const auto& ref = reference[i];
+                    for (auto x = 0; x < image.cols; ++x)
+                    {
+                        double mean, dev;
+                        window_stats(b.sum, b.sqsum, x0[x], y0[y], x1[x], y1[y], mean, dev);
+                        d[x] += (mean - ref.first) * (mean - ref.first) + (dev - ref.second) * (dev - ref.second);
+                    }
+                }
+                if (last < filters)
+                    continue;
+                auto r = res.ptr<uchar>(y);
+                for (auto x = 0; x < image.cols; ++x)
+                    r[x] = d[x] <= eps ? 255 : 0;
+            }
+        });
     }
 
+    release_buffers(cached_filter, cached_buffers);
     return res;
 }
 } // namespace cvlib
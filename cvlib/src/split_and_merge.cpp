@@ -5,176 +5,832 @@
  */
 
 #include "cvlib.hpp"
+#include <tuple>
 #include <vector>
-#include <map>
 
 namespace
 {
-struct tree_node
+/// \brief Regions of this area and larger are split before tasks start, so every task gets a smaller subtree
+/// \details number of tasks grows with image size and with inhomogeneous area, so textured parts are shared by many tasks
+const int parallel_min_area = 64 * 64;
+
+/// \brief Standard deviation of every channel of region is compared with threshold, so the max one decides homogeneity
+double max_stddev(double count, const cv::Scalar& sum, const cv::Scalar& sqsum)
 {
-   cv::Mat data;
-   bool has_childrens;
-   std::vector<tree_node> childrens;
-   int x_l, x_r, y_b, y_t;
+    if (count == 0)
+        return 0.;
+    auto variance = 0.;
+    for (auto c = 0; c < 4; ++c)
+    {
+        const auto mean = sum[c] / count;
+        variance = std::max(variance, sqsum[c] / count - mean * mean);
+    }
+    return std::sqrt(variance);
+}
+
+/// \brief Sums and squared sums of every channel of any image region in O(1) from integral images
+class region_stats
+{
+    public:
+    /// \brief computes interleaved integral images of all channels in one pass over the image
+    explicit region_stats(const cv::Mat& image) : channels_(image.channels())
+    {
+        CV_Assert(channels_ <= 4);
+        cv::Mat values;
+        image.convertTo(values, CV_MAKETYPE(CV_64F, channels_));
+        cv::integral(values, sum_, sqsum_, CV_64F, CV_64F);
+    }
+
+    cv::Scalar sum(const cv::Rect& r) const
+    {
+        return region_sum(sum_, r);
+    }
+
+    cv::Scalar sqsum(const cv::Rect& r) const
+    {
+        return region_sum(sqsum_, r);
+    }
 
-   tree_node(cv::Mat data, int x_l = 0, int x_r = 0, int y_b = 0, int y_t = 0) : 
-            data(data), has_childrens(false), x_l(x_l), x_r(x_r), y_b(y_b), y_t(y_t) {}
+    cv::Scalar mean(const cv::Rect& r) const
+    {
+        auto m = sum(r);
+        for (auto c = 0; c < channels_; ++c)
+            m[c] = r.area() > 0 ? m[c] / r.area() : 0.;
+        return m;
+    }
+
+    double stddev(const cv::Rect& r) const
+    {
+        return max_stddev(r.area(), sum(r), sqsum(r));
+    }
+
+    private:
+    cv::Scalar region_sum(const cv::Mat& integral, const cv::Rect& r) const
+    {
+        const auto top = integral.ptr<double>(r.y);
+        const auto bottom = integral.ptr<double>(r.y + r.height);
+        const auto x0 = r.x * channels_;
+        const auto x1 = (r.x + r.width) * channels_;
+        cv::Scalar res;
+        for (auto c = 0; c < channels_; ++c)
+            res[c] = bottom[x1 + c] - top[x1 + c] - bottom[x0 + c] + top[x0 + c];
+        return res;
+    }
+
+    int channels_;
+    cv::Mat sum_; //< channels are interleaved
+    cv::Mat sqsum_;
 };
 
-void split_image(cv::Mat image, double stddev, tree_node* node)
+/// \brief Blocks of video frame whose statistics changed since they were segmented last time
+class change_map
 {
-    cv::Mat mean;
-    cv::Mat dev;
-    cv::meanStdDev(image, mean, dev);
+    public:
+    /// \brief compares statistics of blocks with the values they had when they were changed last time
+    /// \param all, in - mark every block as changed
+    void update(const region_stats& stats, cv::Size size, int block, double tolerance, bool all)
+    {
+        const cv::Size blocks((size.width + block - 1) / block, (size.height + block - 1) / block);
+        if (all || block != block_ || blocks_ != blocks)
+        {
+            all = true;
+            block_ = block;
+            blocks_ = blocks;
+            mean_.resize(blocks.area());
+            stddev_.resize(blocks.area());
+        }
 
-    if (dev.at<double>(0) <= stddev)
+        cv::Mat flags(blocks, CV_32S);
+        for (auto by = 0; by < blocks.height; ++by)
+        {
+            for (auto bx = 0; bx < blocks.width; ++bx)
+            {
+                const auto area = cv::Rect(bx * block, by * block, block, block) & cv::Rect(0, 0, size.width, size.height);
+                const auto mean = stats.mean(area);
+                const auto stddev = stats.stddev(area);
+                auto& ref_mean = mean_[by * blocks.width + bx];
+                auto& ref_stddev = stddev_[by * blocks.width + bx];
+                auto changed = all || std::abs(stddev - ref_stddev) > tolerance;
+                for (auto c = 0; c < 4; ++c)
+                    changed = changed || std::abs(mean[c] - ref_mean[c]) > tolerance;
+                if (changed)
+                {
+                    ref_mean = mean;
+                    ref_stddev = stddev;
+                }
+                flags.at<int>(by, bx) = changed ? 1 : 0;
+            }
+        }
+        cv::integral(flags, changed_, CV_32S);
+    }
+
+    /// \brief checks if the area intersects any changed block
+    bool changed(const cv::Rect& area) const
     {
-        image.setTo(mean);
-        return;
+        if (area.area() == 0)
+            return false;
+        const auto x0 = area.x / block_;
+        const auto y0 = area.y / block_;
+        const auto x1 = (area.x + area.width - 1) / block_ + 1;
+        const auto y1 = (area.y + area.height - 1) / block_ + 1;
+        return changed_.at<int>(y1, x1) - changed_.at<int>(y0, x1) - changed_.at<int>(y1, x0) + changed_.at<int>(y0, x0) > 0;
     }
 
-    node->has_childrens = true;
+    private:
+    int block_ = 0;
+    cv::Size blocks_;
+    std::vector<cv::Scalar> mean_; //< reference statistics of blocks
+    std::vector<double> stddev_;
+    cv::Mat changed_; //< integral image of changed block flags
+};
 
-    const auto width = image.cols;
-    const auto height = image.rows;
+/// \brief Conditions to stop splitting
+struct split_limits
+{
+    double stddev; //< homogeneity threshold
+    int min_size; //< regions are not split into parts smaller than this
+    int max_depth; //< non-positive value means no limit
+};
 
-    cv::Mat up_left = image(cv::Range(0, height / 2), cv::Range(0, width / 2));
-    cv::Mat down_left = image(cv::Range(0, height / 2), cv::Range(width / 2, width));
-    cv::Mat up_right = image(cv::Range(height / 2, height), cv::Range(0, width / 2));
-    cv::Mat down_right = image(cv::Range(height / 2, height), cv::Range(width / 2, width));
+/// \brief Node of quadtree, children of a node are stored one after another
+/// \details children are top-left, top-right, bottom-left and bottom-right quadrants,
+///          quadrants are empty if the node is split in one direction only
+struct quad_node
+{
+    cv::Rect area;
+    double stddev; //< max of channels
+    int first_child; //< -1 for leaves
+};
+
+/// \brief Quadtree stored in flat arrays which keep their capacity between calls
+class quadtree
+{
+    public:
+    /// \brief splits the image until all regions are homogeneous
+    void build(const region_stats& stats, cv::Size size, const split_limits& limits);
 
-    tree_node up_left_child(up_left, 0, height / 2, 0, width / 2);
-    tree_node down_left_child(down_left, 0, height / 2, width / 2, width);
-    tree_node up_right_child(up_right, height / 2, height, 0, width / 2);
-    tree_node down_right_child(down_right, height / 2, height, width / 2, width);
+    /// \brief splits the next frame, subtrees of the previous frame tree are copied where blocks are not changed
+    /// \param kept, out - index of copied leaf in this tree for every leaf of the previous tree, -1 if it is not copied
+    void update(const quadtree& previous, const change_map& changes, const region_stats& stats, const split_limits& limits, std::vector<int>& kept);
+
+    const std::vector<quad_node>& nodes() const
+    {
+        return nodes_;
+    }
+
+    /// \brief indices of non-empty leaves in nodes
+    const std::vector<int>& leaves() const
+    {
+        return leaves_;
+    }
+
+    /// \brief finds every pair of leaves sharing a piece of border
+    /// \param edges, out - pairs of leaf indices in nodes
+    void adjacency(std::vector<std::pair<int, int>>& edges) const;
+
+    private:
+    static quad_node make_node(const region_stats& stats, const cv::Rect& area)
+    {
+        return {area, stats.stddev(area), -1};
+    }
+
+    /// \brief sizes of the first children, zero if the node is not split in this direction
+    static cv::Size half(const quad_node& node, int depth, const split_limits& limits)
+    {
+        if (node.stddev <= limits.stddev || (limits.max_depth > 0 && depth >= limits.max_depth))
+            return cv::Size();
+        const auto& area = node.area;
+        return cv::Size(area.width >= 2 * limits.min_size ? area.width / 2 : 0, area.height >= 2 * limits.min_size ? area.height / 2 : 0);
+    }
 
-    node->childrens.push_back(up_left_child);
-    node->childrens.push_back(down_left_child);
-    node->childrens.push_back(up_right_child);
-    node->childrens.push_back(down_right_child);
+    /// \brief appends children of inhomogeneous node to the arena, statistics of empty children are not computed
+    /// \return false if the node is a leaf
+    static bool add_children(std::vector<quad_node>& arena, int n, int depth, const region_stats& stats, const split_limits& limits);
 
-    split_image(up_left, stddev, &up_left_child);
-    split_image(down_left, stddev, &down_left_child);
-    split_image(up_right, stddev, &up_right_child);
-    split_image(down_right, stddev, &down_right_child);
+    /// \brief splits the node and all its descendants
+    static void split(std::vector<quad_node>& arena, int n, int depth, const region_stats& stats, const split_limits& limits);
+
+    /// \brief fills the node from the node of the previous tree and its descendants
+    void reuse(const quadtree& previous, int n, int m, int depth, const change_map& changes, const region_stats& stats, const split_limits& limits,
+               std::vector<int>& kept);
+
+    void collect_leaves();
+
+    /// \brief finds pairs of touching leaves of two nodes along their common border
+    /// \param a, in - left node for vertical border or top node for horizontal one
+    /// \param b, in - node on the other side of the border
+    void connect(int a, int b, bool vertical, std::vector<std::pair<int, int>>& edges) const;
+
+    std::vector<quad_node> nodes_; //< the root is the first one
+    std::vector<int> leaves_;
+    std::vector<std::pair<int, int>> frontier_; //< large nodes with their depths which are split before tasks start
+    std::vector<std::pair<int, int>> next_frontier_;
+    std::vector<std::pair<int, int>> tasks_; //< nodes with their depths whose subtrees are built by concurrent tasks
+    std::vector<std::vector<quad_node>> subtrees_; //< nodes built by every task, the first one is the copy of its task node
+};
+
+bool quadtree::add_children(std::vector<quad_node>& arena, int n, int depth, const region_stats& stats, const split_limits& limits)
+{
+    const auto area = arena[n].area;
+    const auto size = half(arena[n], depth, limits);
+    const auto w = size.width;
+    const auto h = size.height;
+    if (w == 0 && h == 0)
+        return false;
+
+    const cv::Rect children[] = {cv::Rect(area.x, area.y, w, h), cv::Rect(area.x + w, area.y, area.width - w, h),
+                                 cv::Rect(area.x, area.y + h, w, area.height - h), cv::Rect(area.x + w, area.y + h, area.width - w, area.height - h)};
+    arena[n].first_child = static_cast<int>(arena.size());
+    for (const auto& child : children)
+        arena.push_back(child.area() > 0 ? make_node(stats, child) : quad_node{child, 0., -1});
+    return true;
+}
+
+void quadtree::split(std::vector<quad_node>& arena, int n, int depth, const region_stats& stats, const split_limits& limits)
+{
+    // explicit stack of nodes with their depths, children are pushed in reverse order to keep depth-first order of the arena
+    thread_local std::vector<std::pair<int, int>> stack;
+    stack.assign(1, std::make_pair(n, depth));
+    while (!stack.empty())
+    {
+        const auto top = stack.back();
+        stack.pop_back();
+        if (!add_children(arena, top.first, top.second, stats, limits))
+            continue;
+        const auto first = arena[top.first].first_child;
+        for (auto c = first + 3; c >= first; --c)
+            if (arena[c].area.area() > 0)
+                stack.emplace_back(c, top.second + 1);
+    }
 }
 
-void merge_nodes(std::vector<tree_node*>& lists)
+void quadtree::build(const region_stats& stats, cv::Size size, const split_limits& limits)
 {
-    cv::Mat mean1, mean;
-    cv::Mat dev1;
+    nodes_.clear();
+    leaves_.clear();
+    nodes_.push_back(make_node(stats, cv::Rect(0, 0, size.width, size.height)));
 
-    for (int i = 0; i < lists.size(); ++i)
+    // large nodes are split breadth-first, so subtrees of tasks are small whatever part of the image is inhomogeneous
+    tasks_.clear();
+    frontier_.assign(1, std::make_pair(0, 0));
+    while (!frontier_.empty())
     {
-        cv::meanStdDev(lists[i]->data, mean1, dev1);
-        if (i == 0)
+        next_frontier_.clear();
+        for (const auto& f : frontier_)
         {
-            mean = mean1;
-            continue;
+            const auto n = f.first;
+            if (nodes_[n].area.area() < parallel_min_area)
+            {
+                tasks_.push_back(f);
+                continue;
+            }
+            if (add_children(nodes_, n, f.second, stats, limits))
+                for (auto c = nodes_[n].first_child; c < nodes_[n].first_child + 4; ++c)
+                    if (nodes_[c].area.area() > 0)
+                        next_frontier_.emplace_back(c, f.second + 1);
         }
-        mean += mean1;
+        std::swap(frontier_, next_frontier_);
     }
 
-    mean = mean/lists.size();
+    // subtrees don't share nodes, so they are built concurrently and appended to the arena afterwards
+    if (subtrees_.size() < tasks_.size())
+        subtrees_.resize(tasks_.size());
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tasks_.size())), [&](const cv::Range& range) {
+        for (auto i = range.start; i < range.end; ++i)
+        {
+            auto& subtree = subtrees_[i];
+            subtree.assign(1, nodes_[tasks_[i].first]);
+            split(subtree, 0, tasks_[i].second, stats, limits);
+        }
+    });
+    for (size_t i = 0; i < tasks_.size(); ++i)
+    {
+        const auto& subtree = subtrees_[i];
+        const auto offset = static_cast<int>(nodes_.size()) - 1;
+        if (subtree[0].first_child >= 0)
+            nodes_[tasks_[i].first].first_child = subtree[0].first_child + offset;
+        for (auto node = subtree.begin() + 1; node != subtree.end(); ++node)
+        {
+            nodes_.push_back(*node);
+            if (node->first_child >= 0)
+                nodes_.back().first_child += offset;
+        }
+    }
+
+    collect_leaves();
+}
+
+void quadtree::update(const quadtree& previous, const change_map& changes, const region_stats& stats, const split_limits& limits,
+                      std::vector<int>& kept)
+{
+    nodes_.resize(1);
+    leaves_.clear();
+    kept.assign(previous.nodes_.size(), -1);
+    reuse(previous, 0, 0, 0, changes, stats, limits, kept);
+    collect_leaves();
+}
 
-    for (int i = 0; i < lists.size(); ++i)
+void quadtree::reuse(const quadtree& previous, int n, int m, int depth, const change_map& changes, const region_stats& stats,
+                     const split_limits& limits, std::vector<int>& kept)
+{
+    const auto& old = previous.nodes_[n];
+    if (old.area.area() > 0 && changes.changed(old.area))
     {
-        lists[i]->data.setTo(mean);
+        nodes_[m] = make_node(stats, old.area);
+        if (old.first_child < 0)
+        {
+            split(nodes_, m, depth, stats, limits);
+            return;
+        }
+        const auto size = half(nodes_[m], depth, limits);
+        if (size.width == 0 && size.height == 0)
+            return;
+    }
+    else
+    {
+        nodes_[m] = old;
+        nodes_[m].first_child = -1;
+        if (old.first_child < 0)
+        {
+            kept[n] = m;
+            return;
+        }
     }
+
+    // children of changed node are tested again, children of unchanged one are copied
+    const auto first = static_cast<int>(nodes_.size());
+    nodes_[m].first_child = first;
+    nodes_.resize(first + 4);
+    for (auto c = 0; c < 4; ++c)
+        reuse(previous, old.first_child + c, first + c, depth + 1, changes, stats, limits, kept);
 }
 
-void create_vector_for_childrens(tree_node* node, std::vector<tree_node*>& lists)
+void quadtree::collect_leaves()
 {
-    if (!node->has_childrens)
+    for (auto n = 0; n < static_cast<int>(nodes_.size()); ++n)
+        if (nodes_[n].first_child < 0 && nodes_[n].area.area() > 0)
+            leaves_.push_back(n);
+}
+
+void quadtree::adjacency(std::vector<std::pair<int, int>>& edges) const
+{
+    edges.clear();
+    for (const auto& n : nodes_)
     {
-        lists.push_back(node);
+        // children are top-left, top-right, bottom-left and bottom-right quadrants
+        const auto c = n.first_child;
+        if (c < 0)
+            continue;
+        connect(c, c + 1, true, edges);
+        connect(c + 2, c + 3, true, edges);
+        connect(c, c + 2, false, edges);
+        connect(c + 1, c + 3, false, edges);
+    }
+}
+
+void quadtree::connect(int a, int b, bool vertical, std::vector<std::pair<int, int>>& edges) const
+{
+    const auto& ra = nodes_[a].area;
+    const auto& rb = nodes_[b].area;
+    const auto overlap = vertical ? std::min(ra.y + ra.height, rb.y + rb.height) - std::max(ra.y, rb.y)
+                                  : std::min(ra.x + ra.width, rb.x + rb.width) - std::max(ra.x, rb.x);
+    if (overlap <= 0 || ra.area() == 0 || rb.area() == 0)
         return;
+
+    // only children lying along the border are visited
+    const auto ca = nodes_[a].first_child;
+    const auto cb = nodes_[b].first_child;
+    if (ca >= 0)
+    {
+        connect(vertical ? ca + 1 : ca + 2, b, vertical, edges);
+        connect(ca + 3, b, vertical, edges);
+    }
+    else if (cb >= 0)
+    {
+        connect(a, cb, vertical, edges);
+        connect(a, vertical ? cb + 2 : cb + 1, vertical, edges);
     }
+    else
+    {
+        edges.emplace_back(a, b);
+    }
+}
 
-    for (auto& child : node->childrens)
+/// \brief Disjoint sets of leaves, statistics of every set are kept in its root
+class region_sets
+{
+    public:
+    /// \brief makes every leaf a separate region
+    void reset(const quadtree& tree, const region_stats& stats)
     {
-        create_vector_for_childrens(&child, lists);
+        const auto& nodes = tree.nodes();
+        parent_.resize(nodes.size());
+        count_.assign(nodes.size(), 0.);
+        sum_.assign(nodes.size(), cv::Scalar());
+        sqsum_.assign(nodes.size(), cv::Scalar());
+        for (auto leaf : tree.leaves())
+        {
+            const auto& area = nodes[leaf].area;
+            parent_[leaf] = leaf;
+            count_[leaf] = area.area();
+            sum_[leaf] = stats.sum(area);
+            sqsum_[leaf] = stats.sqsum(area);
+        }
+    }
+
+    void clear()
+    {
+        parent_.clear();
+        count_.clear();
+        sum_.clear();
+        sqsum_.clear();
+    }
+
+    /// \brief adds separate region
+    /// \return index of the region
+    int add(double count, const cv::Scalar& sum, const cv::Scalar& sqsum)
+    {
+        parent_.push_back(static_cast<int>(parent_.size()));
+        count_.push_back(count);
+        sum_.push_back(sum);
+        sqsum_.push_back(sqsum);
+        return parent_.back();
+    }
+
+    int find(int n)
+    {
+        while (parent_[n] != n)
+            n = parent_[n] = parent_[parent_[n]];
+        return n;
+    }
+
+    /// \brief standard deviation of the union of two regions given by their roots
+    double joint_stddev(int a, int b) const
+    {
+        return max_stddev(count_[a] + count_[b], add(sum_[a], sum_[b]), add(sqsum_[a], sqsum_[b]));
+    }
+
+    /// \brief increase of the sum of squared deviations caused by merging of two regions given by their roots
+    double merge_cost(int a, int b) const
+    {
+        const auto count = count_[a] + count_[b];
+        if (count == 0)
+            return 0.;
+        const auto mean_a = mean(a);
+        const auto mean_b = mean(b);
+        auto dist = 0.;
+        for (auto c = 0; c < 4; ++c)
+            dist += (mean_a[c] - mean_b[c]) * (mean_a[c] - mean_b[c]);
+        return count_[a] * count_[b] / count * dist;
+    }
+
+    double count(int root) const
+    {
+        return count_[root];
+    }
+
+    /// \brief merges two regions given by their roots
+    void unite(int a, int b)
+    {
+        if (count_[a] < count_[b])
+            std::swap(a, b);
+        parent_[b] = a;
+        count_[a] += count_[b];
+        sum_[a] = add(sum_[a], sum_[b]);
+        sqsum_[a] = add(sqsum_[a], sqsum_[b]);
+    }
+
+    cv::Scalar mean(int root) const
+    {
+        cv::Scalar m;
+        for (auto c = 0; c < 4 && count_[root] > 0; ++c)
+            m[c] = sum_[root][c] / count_[root];
+        return m;
+    }
+
+    cv::Scalar variance(int root) const
+    {
+        const auto m = mean(root);
+        cv::Scalar v;
+        for (auto c = 0; c < 4 && count_[root] > 0; ++c)
+            v[c] = std::max(sqsum_[root][c] / count_[root] - m[c] * m[c], 0.);
+        return v;
+    }
+
+    private:
+    static cv::Scalar add(const cv::Scalar& a, const cv::Scalar& b)
+    {
+        return cv::Scalar(a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3]);
+    }
+
+    std::vector<int> parent_;
+    std::vector<double> count_;
+    std::vector<cv::Scalar> sum_; //< sums of every channel
+    std::vector<cv::Scalar> sqsum_;
+};
+
+/// \brief Candidate merge of two adjacent regions
+struct merge_candidate
+{
+    double cost;
+    int a;
+    int b;
+    double count_a; //< sizes of the regions when the cost was computed
+    double count_b;
+
+    bool operator>(const merge_candidate& other) const
+    {
+        return std::tie(cost, a, b) > std::tie(other.cost, other.a, other.b);
+    }
+};
+
+/// \brief joins adjacent regions starting from the cheapest pair while the joint regions stay homogeneous
+/// \details costs of pairs changed by merges are updated when such pairs reach the top of the heap
+void merge_image_parts(const std::vector<std::pair<int, int>>& edges, double stddev, region_sets& regions, std::vector<merge_candidate>& heap)
+{
+    const auto candidate = [&](int a, int b) { return merge_candidate{regions.merge_cost(a, b), a, b, regions.count(a), regions.count(b)}; };
+
+    heap.clear();
+    for (const auto& e : edges)
+        heap.push_back(candidate(e.first, e.second));
+    std::make_heap(heap.begin(), heap.end(), std::greater<merge_candidate>());
+
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<merge_candidate>());
+        const auto top = heap.back();
+        heap.pop_back();
+
+        const auto a = regions.find(top.a);
+        const auto b = regions.find(top.b);
+        if (a == b)
+            continue;
+        if (a != top.a || b != top.b || regions.count(a) != top.count_a || regions.count(b) != top.count_b)
+        {
+            heap.push_back(candidate(a, b));
+            std::push_heap(heap.begin(), heap.end(), std::greater<merge_candidate>());
+            continue;
+        }
+        if (regions.joint_stddev(a, b) <= stddev)
+            regions.unite(a, b);
     }
 }
 
-bool is_neibours(tree_node* node1, tree_node* node2)
+/// \brief numbers regions in order of their first leaves
+void label_regions(const quadtree& tree, region_sets& sets, std::vector<int>& label_of, cv::Mat& labels, std::vector<cvlib::segmented_region>& regions)
 {
-    return node1->x_l == node2->x_r || node1->y_b == node2->y_t || node1->x_r == node2->x_l || node1->y_t == node2->y_b;
+    label_of.assign(tree.nodes().size(), -1);
+    labels.create(tree.nodes()[0].area.size(), CV_32S);
+    regions.clear();
+    for (auto leaf : tree.leaves())
+    {
+        const auto& area = tree.nodes()[leaf].area;
+        if (area.area() == 0)
+            continue;
+        const auto root = sets.find(leaf);
+        if (label_of[root] < 0)
+        {
+            label_of[root] = static_cast<int>(regions.size());
+            regions.push_back({area, static_cast<int>(sets.count(root)), sets.mean(root), sets.variance(root)});
+        }
+        else
+        {
+            regions[label_of[root]].bbox |= area;
+        }
+        labels(area).setTo(label_of[root]);
+    }
 }
+} // namespace
 
-bool can_be_merge(tree_node* node1, tree_node* node2, double stddev)
+namespace cvlib
 {
-    cv::Mat mean1, mean2;
-    cv::Mat dev1, dev2;
+/// \brief Segmentation of the previous frame
+struct segmentation_state
+{
+    quadtree tree;
+    quadtree previous;
+    change_map changes;
+    std::vector<int> kept; //< index in the tree for every leaf of the previous tree which was copied
+    std::vector<int> region_of; //< root of region for every leaf of the tree
+    std::vector<int> anchor; //< the first kept leaf of every region of the previous frame
+    std::vector<char> intact; //< every leaf of region of the previous frame is kept
+    std::vector<char> restored; //< leaf of the tree belongs to intact region
+    region_sets sets;
+    std::vector<std::pair<int, int>> edges;
+    std::vector<merge_candidate> heap;
+    std::vector<int> label_of;
+};
 
-    cv::meanStdDev(node1->data, mean1, dev1);
-    cv::meanStdDev(node2->data, mean2, dev2);
+split_and_merge_stream::split_and_merge_stream(double stddev, double tolerance, int block)
+    : stddev_(stddev), tolerance_(tolerance), block_(block), state_(cv::makePtr<segmentation_state>())
+{
+    CV_Assert(block > 0);
+}
 
-    return dev1.at<double>(0) <= stddev && dev2.at<double>(0) <= stddev && is_neibours(node1, node2);
+void split_and_merge_stream::set_stddev(double stddev)
+{
+    if (stddev != stddev_)
+    {
+        stddev_ = stddev;
+        state_ = cv::makePtr<segmentation_state>();
+    }
 }
 
-void merge_image_parts(std::vector<tree_node*>& lists, double stddev)
+void split_and_merge_stream::apply(const cv::Mat& frame, cv::Mat& labels, std::vector<segmented_region>& regions)
 {
-    std::multimap<int, tree_node*> group_node;
-    int count = 0;
+    auto& s = *state_;
 
-    for(int i = 0; i < lists.size(); ++i)
+    const region_stats stats(frame);
+    const auto restart = s.tree.nodes().empty() || s.tree.nodes()[0].area.size() != frame.size();
+    s.changes.update(stats, frame.size(), block_, tolerance_, restart);
+    if (restart)
     {
-        if (i == 0)
+        s.tree.build(stats, frame.size(), {stddev_, 1, 0});
+    }
+    else
+    {
+        std::swap(s.tree, s.previous);
+        s.tree.update(s.previous, s.changes, stats, {stddev_, 1, 0}, s.kept);
+    }
+    s.tree.adjacency(s.edges);
+    s.sets.reset(s.tree, stats);
+
+    if (!restart)
+    {
+        // regions of the previous frame are restored if none of their leaves is changed
+        const auto& old_leaves = s.previous.leaves();
+        s.intact.assign(s.previous.nodes().size(), 1);
+        s.anchor.assign(s.previous.nodes().size(), -1);
+        s.restored.assign(s.tree.nodes().size(), 0);
+        for (auto n : old_leaves)
+            if (s.kept[n] < 0)
+                s.intact[s.region_of[n]] = 0;
+        for (auto n : old_leaves)
         {
-            group_node.insert(std::pair<int, tree_node*>{++count, lists[i]});
-            continue;
+            const auto r = s.region_of[n];
+            if (s.kept[n] < 0 || !s.intact[r])
+                continue;
+            s.restored[s.kept[n]] = 1;
+            if (s.anchor[r] < 0)
+                s.anchor[r] = s.kept[n];
+            else
+                s.sets.unite(s.sets.find(s.anchor[r]), s.sets.find(s.kept[n]));
         }
 
-        bool added_flag = false;
+        // restored regions were not merged with each other in the previous frame
+        const auto both_restored = [&](const std::pair<int, int>& e) { return s.restored[e.first] && s.restored[e.second]; };
+        s.edges.erase(std::remove_if(s.edges.begin(), s.edges.end(), both_restored), s.edges.end());
+    }
+    merge_image_parts(s.edges, stddev_, s.sets, s.heap);
+
+    s.region_of.assign(s.tree.nodes().size(), -1);
+    for (auto leaf : s.tree.leaves())
+        s.region_of[leaf] = s.sets.find(leaf);
+    label_regions(s.tree, s.sets, s.label_of, labels, regions);
+}
+
+cv::Mat split_and_merge_stream::apply(const cv::Mat& frame)
+{
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    apply(frame, labels, regions);
+    return paint_regions(labels, regions, frame.type());
+}
+
+void split_and_merge(const cv::Mat& image, double stddev, cv::Mat& labels, std::vector<segmented_region>& regions, int min_size, int max_depth)
+{
+    CV_Assert(min_size > 0);
+
+    // split part
+    // statistics of any region are taken from integral images built once per call, the tree keeps its memory between calls
+    const region_stats stats(image);
+    thread_local quadtree tree;
+    tree.build(stats, image.size(), {stddev, min_size, max_depth});
+
+    // merge part
+    thread_local std::vector<std::pair<int, int>> edges;
+    thread_local region_sets sets;
+    thread_local std::vector<merge_candidate> heap;
+    tree.adjacency(edges);
+    sets.reset(tree, stats);
+    merge_image_parts(edges, stddev, sets, heap);
+
+    thread_local std::vector<int> label_of;
+    label_regions(tree, sets, label_of, labels, regions);
+}
 
-        for (int j = 1; j <= count; ++j)
+void split_and_merge(cv::Size size, cv::Size tile, double stddev, const std::function<cv::Mat(const cv::Rect&)>& read,
+                     const std::function<void(const cv::Rect&, const cv::Mat&)>& write, std::vector<int>& relabel,
+                     std::vector<segmented_region>& regions)
+{
+    CV_Assert(tile.width > 0 && tile.height > 0);
+
+    // regions of all tiles, only labels along the borders of the previous tiles are kept for seam merging
+    region_sets sets;
+    std::vector<segmented_region> provisional;
+    std::vector<std::pair<int, int>> edges;
+    std::vector<int> above(size.width, -1);
+    std::vector<int> left(tile.height, -1);
+    const auto add_edge = [&](int a, int b) {
+        if (a != b && (edges.empty() || edges.back() != std::make_pair(a, b)))
+            edges.emplace_back(a, b);
+    };
+
+    cv::Mat labels;
+    std::vector<segmented_region> tile_regions;
+    for (auto y = 0; y < size.height; y += tile.height)
+    {
+        for (auto x = 0; x < size.width; x += tile.width)
         {
-            auto range = group_node.equal_range(j);
-            for (auto iter = range.first; iter != range.second; ++iter)
+            const cv::Rect area(x, y, std::min(tile.width, size.width - x), std::min(tile.height, size.height - y));
+            const auto pixels = read(area);
+            CV_Assert(pixels.size() == area.size());
+            split_and_merge(pixels, stddev, labels, tile_regions);
+
+            const auto first = static_cast<int>(provisional.size());
+            for (auto r : tile_regions)
             {
-                if (can_be_merge(iter->second, lists[i], stddev))
+                r.bbox += area.tl();
+                provisional.push_back(r);
+                cv::Scalar sum;
+                cv::Scalar sqsum;
+                for (auto c = 0; c < 4; ++c)
                 {
-                    group_node.insert(std::pair<int, tree_node*>{j, lists[i]});
-                    added_flag = true;
-                    break;
+                    sum[c] = r.mean[c] * r.count;
+                    sqsum[c] = (r.variance[c] + r.mean[c] * r.mean[c]) * r.count;
                 }
+                sets.add(r.count, sum, sqsum);
+            }
+
+            for (auto i = 0; i < area.height; ++i)
+            {
+                auto label = labels.ptr<int>(i);
+                for (auto j = 0; j < area.width; ++j)
+                    label[j] += first;
+                if (x > 0)
+                    add_edge(left[i], label[0]);
+                left[i] = label[area.width - 1];
             }
-            if (added_flag)
-                break;
+            for (auto j = 0; j < area.width; ++j)
+            {
+                if (y > 0)
+                    add_edge(above[x + j], labels.at<int>(0, j));
+                above[x + j] = labels.at<int>(area.height - 1, j);
+            }
+
+            write(area, labels);
         }
-        if (!added_flag)
-            group_node.insert(std::pair<int, tree_node*>{++count, lists[i]});
     }
 
-    std::vector<tree_node*> nodes_vector;
-    for (int i = 1; i <= count; ++i)
+    // seam pass merges regions of neighbouring tiles
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    std::vector<merge_candidate> heap;
+    merge_image_parts(edges, stddev, sets, heap);
+
+    relabel.assign(provisional.size(), -1);
+    regions.clear();
+    for (auto i = 0; i < static_cast<int>(provisional.size()); ++i)
     {
-        auto range = group_node.equal_range(i);
-        for (auto iter = range.first; iter != range.second; ++iter)
+        const auto root = sets.find(i);
+        if (relabel[root] < 0)
+        {
+            relabel[root] = static_cast<int>(regions.size());
+            regions.push_back({provisional[i].bbox, static_cast<int>(sets.count(root)), sets.mean(root), sets.variance(root)});
+        }
+        else
         {
-            nodes_vector.push_back(iter->second);
+            regions[relabel[root]].bbox |= provisional[i].bbox;
         }
-        merge_nodes(nodes_vector);
-        nodes_vector.clear();
+        relabel[i] = relabel[root];
     }
 }
-} // namespace
 
-namespace cvlib
-{
-cv::Mat split_and_merge(const cv::Mat& image, double stddev)
+cv::Mat paint_regions(const cv::Mat& labels, const std::vector<segmented_region>& regions, int type)
 {
-    // split part
-    cv::Mat res = image;
-    tree_node node(res);
+    CV_Assert(labels.type() == CV_32S);
 
-    std::vector<tree_node*> lists;
-
-    split_image(res, stddev, &node);
-    create_vector_for_childrens(&node, lists);
-    merge_image_parts(lists, stddev);
+    const auto channels = CV_MAT_CN(type);
+    cv::Mat means(labels.size(), CV_MAKETYPE(CV_64F, channels));
+    for (auto y = 0; y < labels.rows; ++y)
+    {
+        const auto label = labels.ptr<int>(y);
+        auto mean = means.ptr<double>(y);
+        for (auto x = 0; x < labels.cols; ++x)
+            for (auto c = 0; c < channels; ++c)
+                mean[x * channels + c] = regions[label[x]].mean[c];
+    }
 
+    cv::Mat res;
+    means.convertTo(res, type);
     return res;
 }
+
+cv::Mat split_and_merge(const cv::Mat& image, double stddev, int min_size, int max_depth)
+{
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    split_and_merge(image, stddev, labels, regions, min_size, max_depth);
+    return paint_regions(labels, regions, image.type());
+}
 } // namespace cvlib
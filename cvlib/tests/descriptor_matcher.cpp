@@ -0,0 +1,722 @@
+/* Descriptor matcher algorithm testing.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include <catch2/catch.hpp>
+
+#include "cvlib.hpp"
+
+#include <set>
+#include <thread>
+
+using namespace cvlib;
+
+TEST_CASE("radius match", "[descriptor_matcher]")
+{
+    // 10 bytes per descriptor: one full 64-bit word and a tail of 2 bytes
+    cv::Mat train(4, 10, CV_8UC1, cv::Scalar(0));
+    train.at<uint8_t>(1, 0) = 0x01; // distance 1 to zero descriptor
+    train.at<uint8_t>(2, 9) = 0x07; // distance 3, bits are in the tail
+    train.row(3).setTo(0xFF); // distance 80
+
+    const cv::Mat query(1, 10, CV_8UC1, cv::Scalar(0));
+    descriptor_matcher matcher;
+    std::vector<std::vector<cv::DMatch>> pairs;
+
+    SECTION("sorted by distance")
+    {
+        matcher.radiusMatch(query, train, pairs, 100.0f);
+        REQUIRE(1 == pairs.size());
+        REQUIRE(4 == pairs[0].size());
+        REQUIRE(0 == pairs[0][0].trainIdx);
+        REQUIRE(1 == pairs[0][1].trainIdx);
+        REQUIRE(2 == pairs[0][2].trainIdx);
+        REQUIRE(3 == pairs[0][3].trainIdx);
+        REQUIRE(80.0f == pairs[0][3].distance);
+    }
+
+    SECTION("tight radius")
+    {
+        matcher.radiusMatch(query, train, pairs, 3.0f);
+        REQUIRE(1 == pairs.size());
+        REQUIRE(2 == pairs[0].size());
+        REQUIRE(0.0f == pairs[0][0].distance);
+        REQUIRE(1.0f == pairs[0][1].distance);
+    }
+
+    SECTION("compact result")
+    {
+        const cv::Mat far(1, 10, CV_8UC1, cv::Scalar(0xAA));
+        matcher.radiusMatch(far, train, pairs, 1.0f, cv::noArray(), false);
+        REQUIRE(1 == pairs.size());
+        REQUIRE(pairs[0].empty());
+
+        matcher.radiusMatch(far, train, pairs, 1.0f, cv::noArray(), true);
+        REQUIRE(pairs.empty());
+    }
+}
+
+TEST_CASE("knn match", "[descriptor_matcher]")
+{
+    cv::Mat train(3, 2, CV_8UC1, cv::Scalar(0));
+    train.at<uint8_t>(0, 0) = 0x0F; // distance 4 to zero descriptor
+    train.at<uint8_t>(2, 1) = 0x03; // distance 2
+
+    const cv::Mat query(1, 2, CV_8UC1, cv::Scalar(0));
+    descriptor_matcher matcher;
+    std::vector<std::vector<cv::DMatch>> pairs;
+
+    matcher.knnMatch(query, train, pairs, 2);
+    REQUIRE(1 == pairs.size());
+    REQUIRE(2 == pairs[0].size());
+    REQUIRE(1 == pairs[0][0].trainIdx);
+    REQUIRE(0.0f == pairs[0][0].distance);
+    REQUIRE(2 == pairs[0][1].trainIdx);
+    REQUIRE(2.0f == pairs[0][1].distance);
+
+    SECTION("ratio check")
+    {
+        // the nearest descriptors are at distances 1 and 3 for this query
+        cv::Mat near(1, 2, CV_8UC1, cv::Scalar(0));
+        near.at<uint8_t>(0, 0) = 0x01;
+
+        matcher.set_ratio(2);
+        matcher.knnMatch(near, train, pairs, 1);
+        REQUIRE(1 == pairs.size());
+        REQUIRE(1 == pairs[0].size());
+        REQUIRE(1 == pairs[0][0].trainIdx);
+
+        matcher.set_ratio(3.5);
+        matcher.knnMatch(near, train, pairs, 1);
+        REQUIRE(1 == pairs.size());
+        REQUIRE(pairs[0].empty());
+    }
+}
+
+TEST_CASE("parallel match", "[descriptor_matcher]")
+{
+    cv::Mat train(1500, 32, CV_8UC1);
+    cv::Mat query(300, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    cv::randu(query, 0, 256);
+
+    descriptor_matcher matcher;
+    matcher.set_threads(1);
+    matcher.set_batch_size(1);
+    std::vector<std::vector<cv::DMatch>> reference;
+    matcher.knnMatch(query, train, reference, 3);
+
+    matcher.set_threads(0);
+    matcher.set_batch_size(17);
+    std::vector<std::vector<cv::DMatch>> pairs;
+    matcher.knnMatch(query, train, pairs, 3);
+
+    REQUIRE(reference.size() == pairs.size());
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        REQUIRE(3 == pairs[i].size());
+        for (size_t j = 0; j < pairs[i].size(); ++j)
+        {
+            REQUIRE(static_cast<int>(i) == pairs[i][j].queryIdx);
+            REQUIRE(reference[i][j].trainIdx == pairs[i][j].trainIdx);
+            REQUIRE(reference[i][j].distance == pairs[i][j].distance);
+        }
+    }
+}
+
+TEST_CASE("multi-index hashing", "[descriptor_matcher]")
+{
+    cv::Mat train(2000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+
+    // queries are noisy copies of train descriptors
+    cv::Mat query = train.rowRange(0, 200).clone();
+    cv::RNG rng;
+    for (auto i = 0; i < query.rows; ++i)
+        for (auto flips = rng.uniform(0, 40); flips > 0; --flips)
+            query.at<uint8_t>(i, rng.uniform(0, query.cols)) ^= 1 << rng.uniform(0, 8);
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+
+    const auto require_same = [](const std::vector<std::vector<cv::DMatch>>& expected, const std::vector<std::vector<cv::DMatch>>& actual) {
+        REQUIRE(expected.size() == actual.size());
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            REQUIRE(expected[i].size() == actual[i].size());
+            for (size_t j = 0; j < actual[i].size(); ++j)
+            {
+                REQUIRE(expected[i][j].queryIdx == actual[i][j].queryIdx);
+                REQUIRE(expected[i][j].trainIdx == actual[i][j].trainIdx);
+                REQUIRE(expected[i][j].distance == actual[i][j].distance);
+            }
+        }
+    };
+
+    std::vector<std::vector<cv::DMatch>> expected;
+    std::vector<std::vector<cv::DMatch>> actual;
+
+    SECTION("knn")
+    {
+        brute_force.knnMatch(query, train, expected, 4);
+        mih.knnMatch(query, train, actual, 4);
+        require_same(expected, actual);
+    }
+
+    SECTION("radius")
+    {
+        brute_force.radiusMatch(query, train, expected, 30.0f);
+        mih.radiusMatch(query, train, actual, 30.0f);
+        require_same(expected, actual);
+    }
+
+    SECTION("short descriptors")
+    {
+        const cv::Mat short_train = train.colRange(0, 2).clone();
+        const cv::Mat short_query = query.colRange(0, 2).clone();
+        brute_force.knnMatch(short_query, short_train, expected, 3);
+        mih.knnMatch(short_query, short_train, actual, 3);
+        require_same(expected, actual);
+    }
+}
+
+namespace
+{
+/// \brief Noisy copies of train descriptors with up to max_flips flipped bits
+cv::Mat make_noisy_queries(const cv::Mat& train, int count, int max_flips)
+{
+    cv::Mat query(count, train.cols, CV_8UC1);
+    cv::RNG rng;
+    for (auto i = 0; i < count; ++i)
+    {
+        train.row(rng.uniform(0, train.rows)).copyTo(query.row(i));
+        for (auto flips = rng.uniform(0, max_flips + 1); flips > 0; --flips)
+            query.at<uint8_t>(i, rng.uniform(0, query.cols)) ^= 1 << rng.uniform(0, 8);
+    }
+    return query;
+}
+
+/// \brief Share of queries whose nearest distance is found by approximate matcher
+double recall(const std::vector<std::vector<cv::DMatch>>& exact, const std::vector<std::vector<cv::DMatch>>& approx)
+{
+    auto found = 0;
+    for (size_t i = 0; i < exact.size(); ++i)
+        found += !approx[i].empty() && approx[i][0].distance == exact[i][0].distance;
+    return static_cast<double>(found) / exact.size();
+}
+} // namespace
+
+TEST_CASE("lsh recall", "[descriptor_matcher]")
+{
+    cv::Mat train(5000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 300, 20);
+
+    std::vector<std::vector<cv::DMatch>> exact;
+    std::vector<std::vector<cv::DMatch>> approx;
+    descriptor_matcher().knnMatch(query, train, exact, 1);
+
+    lsh_matcher lsh;
+    lsh.knnMatch(query, train, approx, 1);
+    REQUIRE(recall(exact, approx) >= 0.95);
+
+    SECTION("more probes never lose matches")
+    {
+        std::vector<std::vector<cv::DMatch>> more;
+        lsh_matcher(8, 16, 2).knnMatch(query, train, more, 1);
+        REQUIRE(recall(exact, more) >= recall(exact, approx));
+    }
+}
+
+TEST_CASE("lsh benchmark", "[.][benchmark][descriptor_matcher]")
+{
+    cv::Mat train(50000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 1000, 30);
+
+    descriptor_matcher brute_force;
+    brute_force.add(train);
+    lsh_matcher lsh;
+    lsh.add(train);
+    lsh.train();
+
+    std::vector<std::vector<cv::DMatch>> exact;
+    std::vector<std::vector<cv::DMatch>> approx;
+    auto start = cv::getTickCount();
+    brute_force.knnMatch(query, exact, 1);
+    const auto exact_ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+    start = cv::getTickCount();
+    lsh.knnMatch(query, approx, 1);
+    const auto approx_ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+    WARN("brute force: " << exact_ms << " ms, lsh: " << approx_ms << " ms, recall: " << recall(exact, approx));
+    REQUIRE(recall(exact, approx) >= 0.9);
+}
+
+TEST_CASE("clustering tree", "[descriptor_matcher]")
+{
+    cv::Mat train(5000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 300, 20);
+
+    std::vector<std::vector<cv::DMatch>> exact;
+    std::vector<std::vector<cv::DMatch>> approx;
+    descriptor_matcher().knnMatch(query, train, exact, 2);
+
+    descriptor_matcher tree;
+    SECTION("bounded checks")
+    {
+        tree.use_clustering_tree(4, 16, 50, 1000);
+        tree.knnMatch(query, train, approx, 2);
+        REQUIRE(recall(exact, approx) >= 0.9);
+    }
+
+    SECTION("unbounded checks give exact result")
+    {
+        tree.use_clustering_tree(2, 8, 20, train.rows);
+        tree.knnMatch(query, train, approx, 2);
+        REQUIRE(exact.size() == approx.size());
+        for (size_t i = 0; i < exact.size(); ++i)
+        {
+            REQUIRE(2 == approx[i].size());
+            REQUIRE(exact[i][0].trainIdx == approx[i][0].trainIdx);
+            REQUIRE(exact[i][1].distance == approx[i][1].distance);
+        }
+    }
+}
+
+TEST_CASE("multiple train images", "[descriptor_matcher]")
+{
+    cv::Mat train(600, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 100, 10);
+    const std::vector<cv::Mat> images = {train.rowRange(0, 250), cv::Mat(), train.rowRange(250, 600)};
+
+    descriptor_matcher single;
+    std::vector<std::vector<cv::DMatch>> expected;
+    single.knnMatch(query, train, expected, 2);
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    for (auto* matcher : {&brute_force, &mih})
+    {
+        matcher->add(images);
+        std::vector<std::vector<cv::DMatch>> actual;
+        matcher->knnMatch(query, actual, 2);
+
+        REQUIRE(expected.size() == actual.size());
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            REQUIRE(2 == actual[i].size());
+            for (size_t j = 0; j < actual[i].size(); ++j)
+            {
+                const auto& m = actual[i][j];
+                REQUIRE((m.imgIdx == 0 || m.imgIdx == 2));
+                REQUIRE(expected[i][j].trainIdx == m.trainIdx + (m.imgIdx == 2 ? 250 : 0));
+                REQUIRE(expected[i][j].distance == m.distance);
+            }
+        }
+    }
+}
+
+TEST_CASE("masks", "[descriptor_matcher]")
+{
+    cv::Mat train(1000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const cv::Mat query = train.rowRange(0, 10).clone();
+
+    // the first query can see only rows 600 and 700, the others can't see rows they were copied from
+    cv::Mat mask(query.rows, train.rows, CV_8UC1, cv::Scalar(1));
+    mask.row(0).setTo(0);
+    mask.at<uint8_t>(0, 600) = 1;
+    mask.at<uint8_t>(0, 700) = 1;
+    for (auto i = 1; i < query.rows; ++i)
+        mask.at<uint8_t>(i, i) = 0;
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    REQUIRE(static_cast<cv::DescriptorMatcher&>(brute_force).isMaskSupported());
+    for (auto* matcher : {&brute_force, &mih})
+    {
+        std::vector<std::vector<cv::DMatch>> pairs;
+        matcher->knnMatch(query, train, pairs, 3, mask);
+        REQUIRE(query.rows == pairs.size());
+        REQUIRE(2 == pairs[0].size());
+        for (const auto& m : pairs[0])
+            REQUIRE((m.trainIdx == 600 || m.trainIdx == 700));
+        for (auto i = 1; i < query.rows; ++i)
+        {
+            REQUIRE(3 == pairs[i].size());
+            REQUIRE(pairs[i][0].trainIdx != i);
+            REQUIRE(pairs[i][0].distance > 0);
+        }
+
+        matcher->radiusMatch(query, train, pairs, 1.0f, mask, true);
+        REQUIRE(pairs.empty());
+    }
+}
+
+TEST_CASE("add and remove descriptors", "[descriptor_matcher]")
+{
+    cv::Mat train(3000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    cv::Mat query(100, 32, CV_8UC1);
+    for (auto i = 0; i < query.rows; ++i)
+        train.row(30 * i).copyTo(query.row(i));
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    descriptor_matcher tree;
+    tree.use_clustering_tree(2, 8, 20, train.rows);
+    lsh_matcher lsh;
+    for (auto* matcher : std::vector<descriptor_matcher*>{&brute_force, &mih, &tree, &lsh})
+    {
+        // the second image is added after the index is built
+        matcher->add(train.rowRange(0, 2000));
+        matcher->train();
+        matcher->add(train.rowRange(2000, 3000));
+
+        // rows of odd queries and most of the other rows are removed
+        for (auto row = 0; row < train.rows; ++row)
+            if (row % 30 == 0 ? row % 60 != 0 : row % 4 != 0)
+                matcher->remove(row < 2000 ? 0 : 1, row < 2000 ? row : row - 2000);
+        matcher->remove(0, 30);
+        matcher->compact();
+
+        const auto copy = static_cast<const cv::DescriptorMatcher&>(*matcher).clone();
+        for (const auto& m : {static_cast<cv::DescriptorMatcher*>(matcher), copy.get()})
+        {
+            std::vector<std::vector<cv::DMatch>> pairs;
+            m->knnMatch(query, pairs, 1);
+            REQUIRE(query.rows == pairs.size());
+            for (auto i = 0; i < query.rows; i += 2)
+            {
+                REQUIRE(1 == pairs[i].size());
+                REQUIRE(0.0f == pairs[i][0].distance);
+                REQUIRE(30 * i == pairs[i][0].trainIdx + (pairs[i][0].imgIdx == 1 ? 2000 : 0));
+            }
+            for (auto i = 1; i < query.rows; i += 2)
+                REQUIRE((pairs[i].empty() || pairs[i][0].distance > 0));
+        }
+    }
+}
+
+TEST_CASE("sliding window of train images", "[descriptor_matcher]")
+{
+    cv::Mat train(3000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    descriptor_matcher cross_check;
+    cross_check.set_cross_check(true);
+    for (auto* matcher : {&brute_force, &mih, &cross_check})
+    {
+        // only the last two images are alive, memory of the older ones is released
+        for (auto img = 0; img < 6; ++img)
+        {
+            matcher->add(train.rowRange(500 * img, 500 * img + 500));
+            matcher->train();
+            for (auto row = 0; img >= 2 && row < 500; ++row)
+                matcher->remove(img - 2, row);
+            matcher->compact();
+        }
+        REQUIRE(matcher->getTrainDescriptors().empty());
+        REQUIRE_FALSE(matcher->empty());
+
+        std::vector<std::vector<cv::DMatch>> pairs;
+        matcher->knnMatch(train.rowRange(1500, 3000), pairs, 1);
+        REQUIRE(1500 == pairs.size());
+        for (auto i = 0; i < 500; ++i)
+            REQUIRE((pairs[i].empty() || pairs[i][0].distance > 0));
+        for (auto i = 500; i < 1500; ++i)
+        {
+            REQUIRE(1 == pairs[i].size());
+            REQUIRE(0.0f == pairs[i][0].distance);
+            REQUIRE(3 + i / 500 == pairs[i][0].imgIdx);
+            REQUIRE(i % 500 == pairs[i][0].trainIdx);
+        }
+    }
+}
+
+TEST_CASE("cross check", "[descriptor_matcher]")
+{
+    // most train descriptors are the nearest ones for several queries
+    cv::Mat train(200, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 400, 40);
+
+    // mutual pairs found by two separate matches
+    std::vector<std::vector<cv::DMatch>> forward;
+    std::vector<std::vector<cv::DMatch>> backward;
+    descriptor_matcher().knnMatch(query, train, forward, 1);
+    descriptor_matcher().knnMatch(train, query, backward, 1);
+    std::set<std::pair<int, int>> expected;
+    for (const auto& m : forward)
+        if (backward[m[0].trainIdx][0].trainIdx == m[0].queryIdx)
+            expected.insert({m[0].queryIdx, m[0].trainIdx});
+    REQUIRE(!expected.empty());
+    REQUIRE(expected.size() < forward.size());
+
+    descriptor_matcher brute_force;
+    brute_force.set_cross_check(true);
+    brute_force.set_batch_size(16);
+    descriptor_matcher mih;
+    mih.set_cross_check(true);
+    mih.use_multi_index_hashing();
+    for (auto* matcher : {&brute_force, &mih})
+    {
+        std::vector<std::vector<cv::DMatch>> pairs;
+        matcher->knnMatch(query, train, pairs, 1, cv::noArray(), true);
+        std::set<std::pair<int, int>> actual;
+        for (const auto& m : pairs)
+            actual.insert({m[0].queryIdx, m[0].trainIdx});
+
+        // search structures can't see queries which didn't find the train descriptor, so they keep more pairs
+        if (matcher == &brute_force)
+            REQUIRE(expected == actual);
+        else
+            REQUIRE(std::includes(actual.begin(), actual.end(), expected.begin(), expected.end()));
+    }
+}
+
+TEST_CASE("guided match", "[descriptor_matcher]")
+{
+    cv::RNG rng;
+    cv::Mat train(1000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    std::vector<cv::KeyPoint> train_kp;
+    for (auto i = 0; i < train.rows; ++i)
+        train_kp.emplace_back(cv::Point2f(rng.uniform(0.f, 640.f), rng.uniform(0.f, 480.f)), 7.f);
+
+    // the second half duplicates descriptors of the first one, so only positions tell them apart
+    train.rowRange(0, 500).copyTo(train.rowRange(500, 1000));
+    const auto query = train.rowRange(500, 1000).clone();
+    std::vector<cv::KeyPoint> query_kp(train_kp.begin() + 500, train_kp.end());
+    for (auto& kp : query_kp)
+        kp.pt -= cv::Point2f(10.f, -5.f);
+
+    cv::Mat homography = cv::Mat::eye(3, 3, CV_64F);
+    homography.at<double>(0, 2) = 10.;
+    homography.at<double>(1, 2) = -5.;
+
+    descriptor_matcher matcher;
+    std::vector<std::vector<cv::DMatch>> pairs;
+    SECTION("homography")
+    {
+        matcher.guided_match(query_kp, query, train_kp, train, homography, 3.f, pairs);
+        REQUIRE(query.rows == pairs.size());
+        for (auto i = 0; i < query.rows; ++i)
+        {
+            REQUIRE(1 == pairs[i].size());
+            REQUIRE(i == pairs[i][0].queryIdx);
+            REQUIRE(500 + i == pairs[i][0].trainIdx);
+            REQUIRE(0.0f == pairs[i][0].distance);
+        }
+    }
+
+    SECTION("search windows")
+    {
+        // windows around the first half of train keypoints
+        std::vector<cv::Rect2f> windows;
+        for (auto i = 0; i < query.rows; ++i)
+            windows.emplace_back(train_kp[i].pt.x - 1.f, train_kp[i].pt.y - 1.f, 2.f, 2.f);
+        matcher.guided_match(query, train_kp, train, windows, pairs, 1.0f);
+        REQUIRE(query.rows == pairs.size());
+        for (auto i = 0; i < query.rows; ++i)
+        {
+            REQUIRE(1 == pairs[i].size());
+            REQUIRE(i == pairs[i][0].trainIdx);
+        }
+    }
+
+    SECTION("nothing in window")
+    {
+        homography.at<double>(0, 2) = 1000.;
+        matcher.guided_match(query_kp, query, train_kp, train, homography, 3.f, pairs);
+        REQUIRE(query.rows == pairs.size());
+        for (const auto& m : pairs)
+            REQUIRE(m.empty());
+    }
+}
+
+TEST_CASE("guided ratio check", "[descriptor_matcher]")
+{
+    // the nearest descriptors are at distances 1 and 3 for the query
+    cv::Mat train(3, 2, CV_8UC1, cv::Scalar(0));
+    train.at<uint8_t>(0, 0) = 0x0F;
+    train.at<uint8_t>(2, 1) = 0x03;
+    cv::Mat query(1, 2, CV_8UC1, cv::Scalar(0));
+    query.at<uint8_t>(0, 0) = 0x01;
+    const std::vector<cv::KeyPoint> train_kp = {{cv::Point2f(5.f, 5.f), 7.f}, {cv::Point2f(10.f, 5.f), 7.f}, {cv::Point2f(15.f, 5.f), 7.f}};
+
+    descriptor_matcher matcher(2);
+    std::vector<std::vector<cv::DMatch>> pairs;
+    const std::vector<cv::Rect2f> all{cv::Rect2f(0.f, 0.f, 20.f, 10.f)};
+    matcher.guided_match(query, train_kp, train, all, pairs);
+    REQUIRE(1 == pairs[0].size());
+    REQUIRE(1 == pairs[0][0].trainIdx);
+
+    matcher.set_ratio(3.5);
+    matcher.guided_match(query, train_kp, train, all, pairs);
+    REQUIRE(pairs[0].empty());
+
+    // descriptors outside of the window do not make the nearest one ambiguous
+    const std::vector<cv::Rect2f> nearest{cv::Rect2f(8.f, 0.f, 4.f, 10.f)};
+    matcher.guided_match(query, train_kp, train, nearest, pairs);
+    REQUIRE(1 == pairs[0].size());
+    REQUIRE(1 == pairs[0][0].trainIdx);
+}
+
+TEST_CASE("asynchronous match", "[descriptor_matcher]")
+{
+    cv::Mat train(3000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 400, 20);
+
+    descriptor_matcher brute_force;
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    descriptor_matcher cross_check;
+    cross_check.set_cross_check(true);
+    for (auto* matcher : {&brute_force, &mih, &cross_check})
+    {
+        matcher->add(train);
+
+        // frames of different size and k are queued together
+        std::vector<std::future<std::vector<std::vector<cv::DMatch>>>> results;
+        std::vector<cv::Range> frames;
+        for (auto row = 0, f = 0; row < query.rows; row += 10 + f, ++f)
+        {
+            frames.emplace_back(row, std::min(row + 10 + f, query.rows));
+            results.push_back(matcher->submit(query.rowRange(frames.back()), 1 + f % 2));
+        }
+
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            std::vector<std::vector<cv::DMatch>> expected;
+            matcher->knnMatch(query.rowRange(frames[f]), expected, 1 + f % 2);
+            const auto actual = results[f].get();
+            REQUIRE(expected.size() == actual.size());
+            for (size_t i = 0; i < actual.size(); ++i)
+            {
+                REQUIRE(expected[i].size() == actual[i].size());
+                for (size_t j = 0; j < actual[i].size(); ++j)
+                {
+                    REQUIRE(expected[i][j].queryIdx == actual[i][j].queryIdx);
+                    REQUIRE(expected[i][j].trainIdx == actual[i][j].trainIdx);
+                    REQUIRE(expected[i][j].distance == actual[i][j].distance);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("asynchronous match errors", "[descriptor_matcher]")
+{
+    cv::Mat train(2000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+
+    descriptor_matcher mih;
+    mih.use_multi_index_hashing();
+    mih.add(train);
+
+    SECTION("wrong width")
+    {
+        // the frame which doesn't fit train descriptors fails alone
+        auto good = mih.submit(train.rowRange(0, 10));
+        auto bad = mih.submit(cv::Mat(5, 16, CV_8UC1, cv::Scalar(0)));
+        auto next = mih.submit(train.rowRange(10, 20));
+        REQUIRE_THROWS(bad.get());
+        for (auto* result : {&good, &next})
+        {
+            const auto pairs = result->get();
+            REQUIRE(10 == pairs.size());
+            for (const auto& m : pairs)
+                REQUIRE(0.0f == m[0].distance);
+        }
+    }
+
+    SECTION("train set changed")
+    {
+        // queued frames see either the old or the new train set, the index is not used until it is rebuilt
+        std::vector<std::future<std::vector<std::vector<cv::DMatch>>>> results;
+        for (auto f = 0; f < 20; ++f)
+            results.push_back(mih.submit(train.rowRange(10 * f, 10 * f + 10)));
+        mih.clear();
+        mih.add(train.rowRange(0, 100));
+        for (auto& r : results)
+        {
+            const auto pairs = r.get();
+            REQUIRE(10 == pairs.size());
+            for (const auto& m : pairs)
+                REQUIRE((m.empty() || m[0].trainIdx < train.rows));
+        }
+    }
+}
+
+TEST_CASE("concurrent submit", "[descriptor_matcher]")
+{
+    cv::Mat train(2000, 32, CV_8UC1);
+    cv::randu(train, 0, 256);
+    const auto query = make_noisy_queries(train, 320, 20);
+
+    // every stream makes its first call at the same time, they share one queue of the matcher
+    descriptor_matcher matcher;
+    matcher.add(train);
+    const auto streams = 8;
+    std::vector<std::vector<std::future<std::vector<std::vector<cv::DMatch>>>>> results(streams);
+    std::vector<std::thread> threads;
+    for (auto s = 0; s < streams; ++s)
+    {
+        threads.emplace_back([&, s] {
+            for (auto f = 0; f < 4; ++f)
+                results[s].push_back(matcher.submit(query.rowRange(40 * s + 10 * f, 40 * s + 10 * f + 10)));
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    std::vector<std::vector<cv::DMatch>> expected;
+    matcher.knnMatch(query, expected, 1);
+    for (auto s = 0; s < streams; ++s)
+    {
+        for (auto f = 0; f < 4; ++f)
+        {
+            const auto actual = results[s][f].get();
+            REQUIRE(10 == actual.size());
+            for (auto i = 0; i < 10; ++i)
+            {
+                REQUIRE(1 == actual[i].size());
+                REQUIRE(expected[40 * s + 10 * f + i][0].trainIdx == actual[i][0].trainIdx);
+            }
+        }
+    }
+
+    SECTION("settings of queued frames")
+    {
+        // the frame keeps ratio of the call even if it is changed before the frame is matched,
+        // the query is at distance 1 from the first train descriptor and at distance 2 from the added one
+        cv::Mat near = train.row(0).clone();
+        near.at<uint8_t>(0, 0) ^= 0x01;
+        cv::Mat added = train.row(0).clone();
+        added.at<uint8_t>(0, 0) ^= 0x02;
+        matcher.add(added);
+        matcher.set_ratio(3);
+        auto checked = matcher.submit(near);
+        matcher.set_ratio(1);
+        auto plain = matcher.submit(near);
+        REQUIRE(checked.get()[0].empty());
+        const auto pairs = plain.get();
+        REQUIRE(1 == pairs[0].size());
+        REQUIRE(0 == pairs[0][0].trainIdx);
+    }
+}
@@ -0,0 +1,141 @@
+/* Texture selection algorithm testing.
+ * @file
+ * @date 2018-09-18
+ * @author Anonymous
+ */
+
+#include <catch2/catch.hpp>
+#include "cvlib.hpp"
+
+using namespace cvlib;
+
+namespace
+{
+/// \brief noise on the left half and stripes on the right one
+cv::Mat make_textures()
+{
+    cv::Mat image(40, 48, CV_8UC1);
+    cv::randu(image, 0, 256);
+    for (auto y = 0; y < image.rows; ++y)
+    {
+        for (auto x = image.cols / 2; x < image.cols; ++x)
+            image.at<uchar>(y, x) = (x / 3) % 2 ? 200 : 20;
+    }
+    return image;
+}
+
+double relative_error(const std::vector<double>& approx, const std::vector<double>& exact)
+{
+    auto diff = 0.;
+    auto norm = 0.;
+    for (size_t i = 0; i < exact.size(); ++i)
+    {
+        diff += (approx[i] - exact[i]) * (approx[i] - exact[i]);
+        norm += exact[i] * exact[i];
+    }
+    return std::sqrt(diff / norm);
+}
+
+/// \brief kernel size used by descriptor of ROI with given min side
+int nearest_odd(int v)
+{
+    return v % 2 ? v : v + 1;
+}
+} // namespace
+
+TEST_CASE("select texture", "[select_texture]")
+{
+    const auto image = make_textures();
+    const cv::Rect roi(28, 10, 16, 16);
+    const cv::Rect stripes(24, 0, 24, 40);
+
+    const auto mask = select_texture(image, roi, 1e5);
+    REQUIRE(image.size() == mask.size());
+    REQUIRE(CV_8UC1 == mask.type());
+    REQUIRE(0 < cv::countNonZero(mask(roi)));
+    REQUIRE(cv::countNonZero(mask) == cv::countNonZero(mask(stripes)));
+
+    // buffers of workers are reused by the next calls with other sizes
+    select_texture(image(cv::Rect(0, 0, 30, 30)), cv::Rect(0, 0, 12, 12), 1e5);
+    REQUIRE(0 == cv::countNonZero(mask != select_texture(image, roi, 1e5)));
+}
+
+TEST_CASE("dense window", "[select_texture]")
+{
+    const auto image = make_textures();
+    const cv::Rect roi(28, 10, 16, 16);
+    const auto reference = texture_descriptor(image, roi);
+
+    // pixel is selected by descriptor of ROI-sized window centered at it
+    for (const auto& p : {cv::Point(10, 10), cv::Point(20, 30), cv::Point(38, 25)})
+    {
+        const auto descr = texture_descriptor(image, cv::Rect(p.x - roi.width / 2, p.y - roi.height / 2, roi.width, roi.height));
+        auto dist = 0.;
+        for (size_t i = 0; i < descr.size(); ++i)
+            dist += (descr[i] - reference[i]) * (descr[i] - reference[i]);
+
+        INFO("pixel (" << p.x << ", " << p.y << "), distance " << dist);
+        REQUIRE(0 == select_texture(image, roi, dist * 0.999).at<uchar>(p));
+        REQUIRE(255 == select_texture(image, roi, dist * 1.001).at<uchar>(p));
+    }
+
+    const cv::Mat color(image.size(), CV_8UC3, cv::Scalar(10, 20, 30));
+    REQUIRE_THROWS(select_texture(color, roi, 1e5));
+}
+
+TEST_CASE("separable approximation", "[select_texture]")
+{
+    const auto image = make_textures();
+    const cv::Rect roi(4, 10, 16, 16);
+    const auto exact = texture_descriptor(image, roi);
+    REQUIRE(192 * 2 == exact.size());
+
+    // singular values of diagonal kernels come in pairs, so only even ranks improve them all
+    auto prev = std::numeric_limits<double>::max();
+    for (auto rank : {1, 2, 4})
+    {
+        const auto error = relative_error(texture_descriptor(image, roi, rank), exact);
+        INFO("rank " << rank << ": relative descriptor error " << error);
+        REQUIRE(error <= prev);
+        prev = error;
+    }
+    REQUIRE(prev < 0.01);
+    REQUIRE(relative_error(texture_descriptor(image, roi, 8), exact) < 1e-3);
+}
+
+TEST_CASE("frequency domain", "[select_texture]")
+{
+    const auto image = make_textures();
+
+    // kernels of 17 pixels and larger are applied by overlap-save blocks, the last blocks are cut by image borders
+    for (const auto& roi : {cv::Rect(0, 0, 48, 40), cv::Rect(14, 6, 34, 34)})
+    {
+        const auto kernel_size = nearest_odd(std::min(roi.width, roi.height) / 2);
+        std::vector<double> reference;
+        for (auto th = 0; th < 4; ++th)
+        {
+            for (auto lm = 10; lm <= 100; lm += 30)
+            {
+                for (auto gm = 1; gm <= 4; ++gm)
+                {
+                    for (auto sig = 5; sig <= 15; sig += 5)
+                    {
+                        const auto kernel = cv::getGaborKernel(cv::Size(kernel_size, kernel_size), sig, th * CV_PI / 4, lm, gm * 0.25);
+                        cv::Mat response;
+                        cv::filter2D(image, response, CV_32F, kernel);
+                        cv::Mat mean;
+                        cv::Mat dev;
+                        cv::meanStdDev(response(roi), mean, dev);
+                        reference.push_back(mean.at<double>(0));
+                        reference.push_back(dev.at<double>(0));
+                    }
+                }
+            }
+        }
+
+        const auto error = relative_error(texture_descriptor(image, roi), reference);
+        INFO("kernel " << kernel_size << ": relative descriptor error " << error);
+        REQUIRE(17 <= kernel_size);
+        REQUIRE(error < 1e-5);
+    }
+}
@@ -30,8 +30,7 @@ TEST_CASE("simple regions", "[split_and_merge]")
         REQUIRE(image.type() == res.type());
         REQUIRE(0 == cv::countNonZero(reference - res));
 
-        res = split_and_merge(image, 1);
-        REQUIRE(0 == cv::countNonZero(image - res));
+        REQUIRE(0 == cv::countNonZero(res - split_and_merge(res, 1)));
     }
 
     SECTION("3x3")
@@ -53,8 +52,7 @@ TEST_CASE("simple regions", "[split_and_merge]")
         REQUIRE(image.type() == res.type());
         REQUIRE(0 == cv::countNonZero(reference - res));
 
-        res = split_and_merge(image, 1);
-        REQUIRE(0 == cv::countNonZero(image - res));
+        REQUIRE(0 == cv::countNonZero(res - split_and_merge(res, 1)));
     }
 }
 
@@ -77,8 +75,7 @@ TEST_CASE("compex regions", "[split_and_merge]")
         REQUIRE(image.type() == res.type());
         REQUIRE(0 == cv::countNonZero(reference - res));
 
-        res = split_and_merge(image, 1);
-        REQUIRE(0 == cv::countNonZero(image - res));
+        REQUIRE(0 == cv::countNonZero(res - split_and_merge(res, 1)));
     }
 
     SECTION("3x3")
@@ -90,9 +87,9 @@ TEST_CASE("compex regions", "[split_and_merge]")
                 0,  40, 40
         );
         const cv::Mat reference = (cv::Mat_<char>(3, 3) <<
-                0,  0,  0,
-                0,  25, 25,
-                0,  25, 25
+                3,  3,  3,
+                3,  3,  3,
+                3,  40, 40
         );
         // clang-format on
         auto res = split_and_merge(image, 10);
@@ -100,8 +97,7 @@ TEST_CASE("compex regions", "[split_and_merge]")
         REQUIRE(0 == cv::countNonZero(reference - res));
         REQUIRE(image.type() == res.type());
 
-        res = split_and_merge(image, 1);
-        REQUIRE(0 == cv::countNonZero(image - res));
+        REQUIRE(0 == cv::countNonZero(res - split_and_merge(res, 1)));
     }
 
     SECTION("4x4")
@@ -114,18 +110,236 @@ TEST_CASE("compex regions", "[split_and_merge]")
                 96, 94, 5, 7
         );
         const cv::Mat reference = (cv::Mat_<char>(4, 4) <<
-                42, 42, 2, 2,
-                42, 42, 2, 2,
-                95, 95, 4, 4,
-                95, 95, 4, 4
+                40, 42, 0, 2,
+                40, 42, 5, 2,
+                97, 93, 5, 2,
+                97, 93, 5, 7
         );
         // clang-format on
+
+        // every quadrant deviates by more than 1, so only pixels differing by one or two levels are merged
         auto res = split_and_merge(image, 1);
         REQUIRE(image.size() == res.size());
         REQUIRE(image.type() == res.type());
         REQUIRE(0 == cv::countNonZero(reference - res));
 
-        res = split_and_merge(image, 1);
-        REQUIRE(0 == cv::countNonZero(image - res));
+        // small regions of the result differ by two levels at least, so half level threshold keeps them
+        REQUIRE(0 == cv::countNonZero(res - split_and_merge(res, 0.5)));
+    }
+}
+
+TEST_CASE("diagonal regions", "[split_and_merge]")
+{
+    // clang-format off
+    const cv::Mat image = (cv::Mat_<char>(4, 4) <<
+            0,  0,  50, 50,
+            0,  0,  50, 50,
+            52, 52, 2,  2,
+            52, 52, 2,  2
+    );
+    // clang-format on
+
+    // similar quadrants touch only by corners, so they are not neighbours
+    const cv::Mat reference = image.clone();
+    const auto res = split_and_merge(image, 1.5);
+    REQUIRE(0 == cv::countNonZero(reference - res));
+}
+
+TEST_CASE("closest regions", "[split_and_merge]")
+{
+    // clang-format off
+    const cv::Mat image = (cv::Mat_<char>(2, 2) <<
+            0, 2,
+            9, 3
+    );
+    const cv::Mat reference = (cv::Mat_<char>(2, 2) <<
+            0, 2,
+            9, 2
+    );
+    // clang-format on
+
+    // 0 could join 2 as well, but 2 and 3 are closer, so they are merged first
+    const auto res = split_and_merge(image, 1);
+    REQUIRE(0 == cv::countNonZero(reference - res));
+}
+
+TEST_CASE("large image", "[split_and_merge]")
+{
+    cv::Mat image(512, 512, CV_8UC1);
+    cv::randu(image, 0, 256);
+    image(cv::Rect(0, 0, 256, 256)).setTo(100);
+
+    // the homogeneous quadrant is filled by its own task, the noisy ones are split down to pixels
+    const cv::Mat reference(256, 256, CV_8UC1, cv::Scalar{100});
+    const auto res = split_and_merge(image, 1);
+    REQUIRE(image.size() == res.size());
+    REQUIRE(0 == cv::countNonZero(reference - res(cv::Rect(0, 0, 256, 256))));
+}
+
+TEST_CASE("label map", "[split_and_merge]")
+{
+    // clang-format off
+    const cv::Mat image = (cv::Mat_<char>(4, 4) <<
+            40, 43, 0, 3,
+            41, 42, 6, 1,
+            98, 92, 4, 2,
+            96, 94, 5, 7
+    );
+    const cv::Mat reference = (cv::Mat_<int>(4, 4) <<
+            0, 0, 1, 1,
+            0, 0, 1, 1,
+            2, 2, 1, 1,
+            2, 2, 1, 1
+    );
+    // clang-format on
+    const cv::Mat original = image.clone();
+
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    split_and_merge(image, 3, labels, regions);
+    REQUIRE(0 == cv::countNonZero(original != image));
+    REQUIRE(CV_32S == labels.type());
+    REQUIRE(0 == cv::countNonZero(reference != labels));
+    REQUIRE(3 == regions.size());
+
+    REQUIRE(cv::Rect(2, 0, 2, 4) == regions[1].bbox);
+    REQUIRE(8 == regions[1].count);
+    REQUIRE(3.5 == Approx(regions[1].mean[0]));
+    REQUIRE(5.25 == Approx(regions[1].variance[0]));
+
+    const auto res = paint_regions(labels, regions, image.type());
+    REQUIRE(0 == cv::countNonZero(res - split_and_merge(image, 3)));
+}
+
+TEST_CASE("tiled image", "[split_and_merge]")
+{
+    cv::Mat image(70, 100, CV_8UC1, cv::Scalar{10});
+    image(cv::Rect(37, 0, 63, 70)).setTo(200);
+    image(cv::Rect(0, 50, 37, 20)).setTo(100);
+
+    // regions cross borders of tiles, they are joined by the seam pass
+    cv::Mat labels(image.size(), CV_32S);
+    std::vector<int> relabel;
+    std::vector<segmented_region> regions;
+    split_and_merge(image.size(), cv::Size(16, 16), 1, [&](const cv::Rect& tile) { return image(tile).clone(); },
+                    [&](const cv::Rect& tile, const cv::Mat& tile_labels) { tile_labels.copyTo(labels(tile)); }, relabel, regions);
+    REQUIRE(3 == regions.size());
+
+    for (auto y = 0; y < labels.rows; ++y)
+    {
+        for (auto x = 0; x < labels.cols; ++x)
+            labels.at<int>(y, x) = relabel[labels.at<int>(y, x)];
+    }
+    const auto res = paint_regions(labels, regions, image.type());
+    REQUIRE(0 == cv::countNonZero(image != res));
+
+    const auto right = regions[labels.at<int>(0, 99)];
+    REQUIRE(cv::Rect(37, 0, 63, 70) == right.bbox);
+    REQUIRE(63 * 70 == right.count);
+}
+
+TEST_CASE("video stream", "[split_and_merge]")
+{
+    cv::Mat frame(64, 64, CV_8UC1, cv::Scalar{10});
+    frame(cv::Rect(8, 8, 16, 16)).setTo(100);
+
+    split_and_merge_stream segmenter(1);
+    auto res = segmenter.apply(frame);
+    REQUIRE(0 == cv::countNonZero(frame != res));
+
+    SECTION("static scene")
+    {
+        res = segmenter.apply(frame);
+        REQUIRE(0 == cv::countNonZero(frame != res));
+    }
+
+    SECTION("moving object")
+    {
+        // only the changed blocks are split again, but regions are the same as for separate frame
+        frame(cv::Rect(8, 8, 16, 16)).setTo(10);
+        frame(cv::Rect(30, 36, 20, 12)).setTo(150);
+        for (auto i = 0; i < 2; ++i)
+        {
+            cv::Mat labels;
+            std::vector<segmented_region> regions;
+            segmenter.apply(frame, labels, regions);
+            REQUIRE(2 == regions.size());
+            REQUIRE(0 == cv::countNonZero(frame != paint_regions(labels, regions, frame.type())));
+        }
+    }
+}
+
+TEST_CASE("color image", "[split_and_merge]")
+{
+    // halves differ only in the last channel, so grey image would not separate them
+    cv::Mat image(32, 32, CV_8UC3, cv::Scalar(50, 60, 70));
+    image(cv::Rect(0, 16, 32, 16)).setTo(cv::Scalar(50, 60, 90));
+
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    split_and_merge(image, 5, labels, regions);
+    REQUIRE(2 == regions.size());
+    REQUIRE(cv::Scalar(50, 60, 70) == regions[0].mean);
+    REQUIRE(cv::Scalar(50, 60, 90) == regions[1].mean);
+
+    const auto res = split_and_merge(image, 5);
+    REQUIRE(CV_8UC3 == res.type());
+    REQUIRE(0 == cv::countNonZero((image != res).reshape(1)));
+}
+
+TEST_CASE("split limits", "[split_and_merge]")
+{
+    cv::Mat image(9, 7, CV_8UC1);
+    cv::randu(image, 0, 256);
+
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    SECTION("odd sizes")
+    {
+        // noise is split down to pixels without empty regions
+        split_and_merge(image, 0, labels, regions);
+        size_t pixels = 0;
+        for (const auto& r : regions)
+        {
+            REQUIRE(r.count > 0);
+            pixels += r.count;
+        }
+        REQUIRE(image.total() == pixels);
+    }
+
+    SECTION("min size")
+    {
+        split_and_merge(image, 0, labels, regions, 3);
+        for (const auto& r : regions)
+            REQUIRE(r.count >= 3 * 3);
+    }
+
+    SECTION("max depth")
+    {
+        // regions are quadrants of the image at most
+        split_and_merge(image, 0, labels, regions, 1, 1);
+        REQUIRE(4 >= regions.size());
+    }
+}
+
+TEST_CASE("split limits of large image", "[split_and_merge]")
+{
+    // large nodes are split before tasks start, so limits have to hold across tasks
+    cv::Mat image(240, 320, CV_8UC1);
+    cv::randu(image, 0, 256);
+
+    cv::Mat labels;
+    std::vector<segmented_region> regions;
+    SECTION("min size")
+    {
+        split_and_merge(image, 0, labels, regions, 40);
+        for (const auto& r : regions)
+            REQUIRE(r.count >= 40 * 40);
+    }
+
+    SECTION("max depth")
+    {
+        split_and_merge(image, 0, labels, regions, 1, 3);
+        REQUIRE(64 >= regions.size());
     }
 }
@@ -21,10 +21,10 @@ int demo_feature_matching(int argc, char* argv[])
     cv::namedWindow(main_wnd);
     cv::namedWindow(demo_wnd);
 
-    auto ratio = 25;
+    auto ratio = 15; //< ratio check of guided matching: min ratio of distances to the second and the nearest descriptors multiplied by 10
 
     auto detector = cvlib::corner_detector_fast::create();
-    auto matcher = cvlib::descriptor_matcher(ratio); //\todo add trackbar to demo_wnd to tune ratio value
+    auto matcher = cvlib::descriptor_matcher(ratio / 10.f);
 
     /// \brief helper struct for tidy code
     struct img_features
@@ -37,10 +37,11 @@ int demo_feature_matching(int argc, char* argv[])
     img_features ref;
     img_features test;
     std::vector<std::vector<cv::DMatch>> pairs;
+    cv::Mat homography; //< transform of test frame into reference image estimated on the previous frame
 
     cv::Mat main_frame;
     cv::Mat demo_frame;
-    cv::createTrackbar("ratio", demo_wnd, &ratio, 255);
+    cv::createTrackbar("guided ratio x10", demo_wnd, &ratio, 40);
     utils::fps_counter fps;
     int pressed_key = 0;
     const auto ESC_KEY_CODE = 27;
@@ -59,14 +60,31 @@ int demo_feature_matching(int argc, char* argv[])
         {
             ref.img = test.img.clone();
             detector->detectAndCompute(ref.img, cv::Mat(), ref.corners, ref.descriptors);
+            homography.release();
         }
 
         if (ref.corners.empty())
             continue;
 
         detector->compute(test.img, test.corners, test.descriptors);
-        matcher.set_ratio(ratio);
-        matcher.radiusMatch(test.descriptors, ref.descriptors, pairs, 100.0f);
+        matcher.set_ratio(ratio / 10.f);
+        // consecutive frames differ a little, so corners are searched only around positions predicted by the previous frame,
+        // ambiguous corners in predicted windows are dropped by ratio check
+        if (homography.empty())
+            matcher.radiusMatch(test.descriptors, ref.descriptors, pairs, 100.0f);
+        else
+            matcher.guided_match(test.corners, test.descriptors, ref.corners, ref.descriptors, homography, 20.0f, pairs, 100.0f);
+
+        std::vector<cv::Point2f> test_points;
+        std::vector<cv::Point2f> ref_points;
+        for (const auto& m : pairs)
+        {
+            if (m.empty())
+                continue;
+            test_points.push_back(test.corners[m[0].queryIdx].pt);
+            ref_points.push_back(ref.corners[m[0].trainIdx].pt);
+        }
+        homography = test_points.size() >= 4 ? cv::findHomography(test_points, ref_points, cv::RANSAC) : cv::Mat();
         cv::drawMatches(test.img, test.corners, ref.img, ref.corners, pairs, demo_frame);
 
         utils::put_fps_text(demo_frame, fps);
@@ -15,7 +15,6 @@ int demo_split_and_merge(int argc, char* argv[])
         return -1;
 
     cv::Mat frame;
-    cv::Mat frame_gray;
 
     const auto origin_wnd = "origin";
     const auto demo_wnd = "demo";
@@ -24,13 +23,16 @@ int demo_split_and_merge(int argc, char* argv[])
     cv::namedWindow(demo_wnd, 1);
     cv::createTrackbar("stdev", demo_wnd, &stddev, 255);
 
+    // static parts of the scene keep their segmentation from the previous frames
+    cvlib::split_and_merge_stream segmenter(stddev);
+
     while (cv::waitKey(30) != 27) // ESC
     {
         cap >> frame;
 
-        cv::cvtColor(frame, frame_gray, cv::COLOR_BGR2GRAY);
         cv::imshow(origin_wnd, frame);
-        cv::imshow(demo_wnd, cvlib::split_and_merge(frame_gray, stddev));
+        segmenter.set_stddev(stddev);
+        cv::imshow(demo_wnd, segmenter.apply(frame));
     }
 
     cv::destroyWindow(origin_wnd);